@@ -44,12 +44,25 @@ Copyright (c) 2013 Thekla, Inc
 Copyright NVIDIA Corporation 2006 -- Ignacio Castano <icastano@nvidia.com>
 */
 
+#include "core/config/project_settings.h"
+#include "core/crypto/hashing_context.h"
 #include "core/error/error_list.h"
 #include "core/error/error_macros.h"
+#include "core/io/dir_access.h"
+#include "core/io/file_access.h"
 #include "core/io/image.h"
+#include "core/io/marshalls.h"
+#include "core/io/resource_loader.h"
+#include "core/io/resource_saver.h"
+#include "core/math/aabb.h"
 #include "core/math/transform_3d.h"
 #include "core/math/vector2.h"
 #include "core/math/vector3.h"
+#include "core/math/vector3i.h"
+#include "core/object/worker_thread_pool.h"
+#include "core/os/os.h"
+#include "core/templates/hash_set.h"
+#include "core/templates/hashfuncs.h"
 #include "core/templates/local_vector.h"
 #include "editor/editor_node.h"
 #include "modules/scene_merge/mesh_merge_triangle.h"
@@ -59,27 +72,37 @@ Copyright NVIDIA Corporation 2006 -- Ignacio Castano <icastano@nvidia.com>
 #include "scene/resources/material.h"
 #include "scene/resources/surface_tool.h"
 
-#include "thirdparty/misc/rjm_texbleed.h"
 #include "thirdparty/xatlas/xatlas.h"
 #include <cmath>
 #include <cstdint>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MESH_TEXTURE_ATLAS_SSE2
+#endif
+
 #include "merge.h"
 
 bool MeshTextureAtlas::set_atlas_texel(void *param, int x, int y, const Vector3 &bar, const Vector3 &, const Vector3 &, float) {
 	ERR_FAIL_NULL_V(param, false);
 	AtlasTextureArguments *args = static_cast<AtlasTextureArguments *>(param);
-	ERR_FAIL_NULL_V(args, false);
+	if (args->atlas_texels && args->source_texels) {
+		return AtlasTexelSampler{ args }(x, y, bar, 1.0f);
+	}
+	if (static_cast<uint32_t>(x) >= args->atlas_width || static_cast<uint32_t>(y) >= args->atlas_height) {
+		return true;
+	}
 	if (args->source_texture.is_valid()) {
 		const Vector2 source_uv = interpolate_source_uvs(bar, args);
 		Pair<int, int> coordinates = calculate_coordinates(source_uv, args->source_texture->get_width(), args->source_texture->get_height());
 		const Color color = args->source_texture->get_pixel(coordinates.first, coordinates.second);
 		args->atlas_data->set_pixel(x, y, color);
-		int32_t index = y * args->atlas_width + x;
-		AtlasLookupTexel &lookup = args->atlas_lookup[index];
-		lookup.material_index = args->material_index;
-		lookup.x = static_cast<uint16_t>(coordinates.first);
-		lookup.y = static_cast<uint16_t>(coordinates.second);
+		AtlasLookupTexel *lookup = args->atlas_lookup->get_texel(x, y);
+		if (lookup) {
+			lookup->material_index = args->material_index;
+			lookup->x = static_cast<uint16_t>(coordinates.first);
+			lookup->y = static_cast<uint16_t>(coordinates.second);
+		}
 		return true;
 	}
 	return false;
@@ -100,9 +123,9 @@ void MeshTextureAtlas::_find_all_mesh_instances(Vector<MeshMerge> &r_items, Node
 			}
 
 			array_mesh->surface_set_material(surface_i, active_material);
-			Array array = array_mesh->surface_get_arrays(surface_i).duplicate(true);
 			MeshState mesh_state;
 			mesh_state.mesh = array_mesh;
+			mesh_state.surface_index = surface_i;
 			if (mi->is_inside_tree()) {
 				mesh_state.path = mi->get_path();
 			}
@@ -113,7 +136,7 @@ void MeshTextureAtlas::_find_all_mesh_instances(Vector<MeshMerge> &r_items, Node
 			}
 			MeshMerge &mesh = r_items.write[r_items.size() - 1];
 
-			mesh.vertex_count += PackedVector3Array(array[ArrayMesh::ARRAY_VERTEX]).size();
+			mesh.vertex_count += array_mesh->surface_get_array_len(surface_i);
 			mesh_state.index_offset = mesh.vertex_count;
 
 			if (mesh_state.is_valid()) {
@@ -130,456 +153,2140 @@ void MeshTextureAtlas::_find_all_mesh_instances(Vector<MeshMerge> &r_items, Node
 	}
 }
 
+void MeshTextureAtlas::cluster_mesh_items(Vector<MeshMerge> &r_items, const MergeOptions &p_options) {
+	if (r_items.size() != 1 || (p_options.cluster_cell_size <= 0.0f && p_options.cluster_max_triangles <= 0 && p_options.cluster_max_texels <= 0)) {
+		return;
+	}
+	// Surfaces of one instance always stay in the same group.
+	struct ClusterInstance {
+		Vector3 center;
+		int64_t triangles = 0;
+		HashMap<ObjectID, int64_t> textures;
+		LocalVector<int32_t> surfaces;
+	};
+	const Vector<MeshState> meshes = r_items[0].meshes;
+	LocalVector<ClusterInstance> instances;
+	HashMap<ObjectID, uint32_t> instance_ids;
+	for (int32_t mesh_i = 0; mesh_i < meshes.size(); mesh_i++) {
+		const MeshState &mesh_state = meshes[mesh_i];
+		const ObjectID instance_id = mesh_state.mesh_instance->get_instance_id();
+		if (!instance_ids.has(instance_id)) {
+			instance_ids.insert(instance_id, instances.size());
+			instances.push_back(ClusterInstance());
+			instances[instances.size() - 1].center = _get_merge_transform(mesh_state.mesh_instance).xform(mesh_state.mesh->get_aabb().get_center());
+		}
+		ClusterInstance &instance = instances[instance_ids[instance_id]];
+		instance.triangles += mesh_state.mesh->surface_get_array_index_len(mesh_state.surface_index) / 3;
+		instance.surfaces.push_back(mesh_i);
+		// Texel cost is the albedo texture of each material, a texture shared within a group is only counted once.
+		const Ref<BaseMaterial3D> material = mesh_state.mesh->surface_get_material(mesh_state.surface_index);
+		const Ref<Texture2D> texture = material.is_valid() ? material->get_texture(BaseMaterial3D::TEXTURE_ALBEDO) : Ref<Texture2D>();
+		if (texture.is_valid()) {
+			instance.textures.insert(texture->get_instance_id(), int64_t(texture->get_width()) * texture->get_height());
+		}
+	}
+
+	HashMap<Vector3i, LocalVector<uint32_t> > cells;
+	LocalVector<Vector3i> cell_order;
+	for (uint32_t instance_i = 0; instance_i < instances.size(); instance_i++) {
+		Vector3i cell;
+		if (p_options.cluster_cell_size > 0.0f) {
+			cell = Vector3i((instances[instance_i].center / p_options.cluster_cell_size).floor());
+		}
+		if (!cells.has(cell)) {
+			cells.insert(cell, LocalVector<uint32_t>());
+			cell_order.push_back(cell);
+		}
+		cells[cell].push_back(instance_i);
+	}
+
+	struct SortKey {
+		real_t position = 0.0;
+		uint32_t instance = 0;
+		bool operator<(const SortKey &p_other) const {
+			return position < p_other.position || (position == p_other.position && instance < p_other.instance);
+		}
+	};
+	Vector<MeshMerge> groups;
+	for (const Vector3i &cell : cell_order) {
+		const LocalVector<uint32_t> &cell_instances = cells[cell];
+		// Over budget cells are split along their longest axis, so every group stays spatially compact.
+		AABB bounds(instances[cell_instances[0]].center, Vector3());
+		for (uint32_t instance_i : cell_instances) {
+			bounds.expand_to(instances[instance_i].center);
+		}
+		const int32_t axis = bounds.get_longest_axis_index();
+		LocalVector<SortKey> order;
+		for (uint32_t instance_i : cell_instances) {
+			order.push_back({ instances[instance_i].center[axis], instance_i });
+		}
+		order.sort();
+
+		MeshMerge group;
+		HashSet<ObjectID> group_textures;
+		int64_t group_triangles = 0;
+		int64_t group_texels = 0;
+		for (const SortKey &key : order) {
+			const ClusterInstance &instance = instances[key.instance];
+			int64_t new_texels = 0;
+			for (const KeyValue<ObjectID, int64_t> &texture : instance.textures) {
+				if (!group_textures.has(texture.key)) {
+					new_texels += texture.value;
+				}
+			}
+			const bool over_triangles = p_options.cluster_max_triangles > 0 && group_triangles + instance.triangles > p_options.cluster_max_triangles;
+			const bool over_texels = p_options.cluster_max_texels > 0 && group_texels + new_texels > p_options.cluster_max_texels;
+			if (!group.meshes.is_empty() && (over_triangles || over_texels)) {
+				groups.push_back(group);
+				group = MeshMerge();
+				group_textures.clear();
+				group_triangles = 0;
+				group_texels = 0;
+				new_texels = 0;
+				for (const KeyValue<ObjectID, int64_t> &texture : instance.textures) {
+					new_texels += texture.value;
+				}
+			}
+			for (const KeyValue<ObjectID, int64_t> &texture : instance.textures) {
+				group_textures.insert(texture.key);
+			}
+			group_triangles += instance.triangles;
+			group_texels += new_texels;
+			for (int32_t mesh_i : instance.surfaces) {
+				MeshState mesh_state = meshes[mesh_i];
+				group.vertex_count += mesh_state.mesh->surface_get_array_len(mesh_state.surface_index);
+				mesh_state.index_offset = group.vertex_count;
+				group.meshes.push_back(mesh_state);
+			}
+		}
+		if (!group.meshes.is_empty()) {
+			groups.push_back(group);
+		}
+	}
+	print_line(vformat("Clustered %d instances into %d merge groups.", instances.size(), groups.size()));
+	r_items = groups;
+}
+
+uint64_t MeshTextureAtlas::get_material_feature_key(const Ref<BaseMaterial3D> &p_material) {
+	if (p_material.is_null()) {
+		return 0;
+	}
+	uint64_t key = uint64_t(p_material->get_cull_mode());
+	key |= uint64_t(p_material->get_transparency()) << 4;
+	key |= uint64_t(p_material->get_shading_mode()) << 8;
+	key |= uint64_t(p_material->get_blend_mode()) << 12;
+	if (p_material->get_transparency() == BaseMaterial3D::TRANSPARENCY_ALPHA_SCISSOR) {
+		const float threshold = p_material->get_alpha_scissor_threshold();
+		uint32_t threshold_bits = 0;
+		memcpy(&threshold_bits, &threshold, sizeof(threshold_bits));
+		key |= uint64_t(threshold_bits) << 32;
+	}
+	return key;
+}
+
+void MeshTextureAtlas::_copy_material_features(const Ref<BaseMaterial3D> &p_source, const Ref<BaseMaterial3D> &r_material) {
+	ERR_FAIL_COND(p_source.is_null() || r_material.is_null());
+	r_material->set_cull_mode(p_source->get_cull_mode());
+	r_material->set_transparency(p_source->get_transparency());
+	r_material->set_shading_mode(p_source->get_shading_mode());
+	r_material->set_blend_mode(p_source->get_blend_mode());
+	r_material->set_alpha_scissor_threshold(p_source->get_alpha_scissor_threshold());
+}
+
+bool MeshTextureAtlas::_is_opaque_atlas_channel(const MergeState &state, const String &texture_type) {
+	if (texture_type != "albedo") {
+		return true;
+	}
+	// Only transparent groups read the albedo alpha, see partition_mesh_items_by_material.
+	const Ref<BaseMaterial3D> source_material = state.material_cache.get(0);
+	return source_material.is_null() || source_material->get_transparency() == BaseMaterial3D::TRANSPARENCY_DISABLED;
+}
+
+void MeshTextureAtlas::partition_mesh_items_by_material(Vector<MeshMerge> &r_items) {
+	// Surfaces whose materials render differently cannot share one output material, each feature set gets its own group.
+	Vector<MeshMerge> groups;
+	for (const MeshMerge &item : r_items) {
+		HashMap<uint64_t, int32_t> feature_groups;
+		for (MeshState mesh_state : item.meshes) {
+			const Ref<BaseMaterial3D> material = mesh_state.mesh->surface_get_material(mesh_state.surface_index);
+			const uint64_t key = get_material_feature_key(material);
+			HashMap<uint64_t, int32_t>::Iterator E = feature_groups.find(key);
+			if (!E) {
+				E = feature_groups.insert(key, groups.size());
+				groups.push_back(MeshMerge());
+			}
+			MeshMerge &group = groups.write[E->value];
+			group.vertex_count += mesh_state.mesh->surface_get_array_len(mesh_state.surface_index);
+			mesh_state.index_offset = group.vertex_count;
+			group.meshes.push_back(mesh_state);
+		}
+	}
+	if (groups.size() != r_items.size()) {
+		print_line(vformat("Split %d merge groups into %d by material features.", r_items.size(), groups.size()));
+	}
+	r_items = groups;
+}
+
+Node *MeshTextureAtlas::_merge(Node *p_root) {
+	return merge_meshes(p_root, MergeOptions());
+}
+
 void MeshTextureAtlas::_bind_methods() {
-	ClassDB::bind_static_method("MeshTextureAtlas", D_METHOD("merge", "root"), &MeshTextureAtlas::merge_meshes);
+	ClassDB::bind_static_method("MeshTextureAtlas", D_METHOD("merge", "root"), &MeshTextureAtlas::_merge);
 }
 
-Node *MeshTextureAtlas::merge_meshes(Node *p_root) {
+Node *MeshTextureAtlas::merge_meshes(Node *p_root, const MergeOptions &p_options) {
 	MeshMergeState mesh_merge_state;
 	mesh_merge_state.root = p_root;
 	mesh_merge_state.mesh_items.resize(1);
 	_find_all_mesh_instances(mesh_merge_state.mesh_items, p_root, p_root);
+	cluster_mesh_items(mesh_merge_state.mesh_items, p_options);
+	partition_mesh_items_by_material(mesh_merge_state.mesh_items);
+	// Instances are only replaced once every group is merged, a later group may still read the transforms of an instance.
+	Vector<MeshState> merged_items;
 	for (int32_t items_i = 0; items_i < mesh_merge_state.mesh_items.size(); items_i++) {
 		int32_t p_index = items_i;
 		Vector<MeshState> mesh_items = mesh_merge_state.mesh_items[p_index].meshes;
 		Node *root = mesh_merge_state.root;
-		Array mesh_to_index_to_material;
-		Vector<Ref<Material> > material_cache;
-		map_mesh_to_index_to_material(mesh_items, mesh_to_index_to_material, material_cache);
-		Vector<Vector<Vector2> > uv_groups;
-		Vector<Vector<ModelVertex> > model_vertices;
-		write_uvs(mesh_items, uv_groups, mesh_to_index_to_material, model_vertices);
-		xatlas::Atlas *atlas = xatlas::Create();
-		int32_t num_surfaces = 0;
-		for (const MeshState &mesh_item : mesh_items) {
-			num_surfaces += mesh_item.mesh->get_surface_count();
-		}
+		// Every group gets its own output node and tile prefix, so the tiles of one group do not overwrite another's.
+		const String output_name = mesh_merge_state.mesh_items.size() > 1 ? vformat("%s_%d", root->get_name(), items_i) : String(root->get_name());
 		xatlas::PackOptions pack_options;
 		pack_options.bilinear = true;
 		pack_options.padding = 16;
-		pack_options.bruteForce = true;
+		// The packing tier decides bruteForce, see _pack_charts.
+		pack_options.bruteForce = false;
 		pack_options.blockAlign = true;
 		pack_options.rotateCharts = false;
 		pack_options.rotateChartsToAxis = false;
-		pack_options.resolution = 8 * 1024;
-		Vector<AtlasLookupTexel> atlas_lookup;
-		Error err = _generate_atlas(num_surfaces, uv_groups, atlas, mesh_items, material_cache, pack_options);
-		ERR_FAIL_COND_V(err != OK, root);
-		atlas_lookup.resize(atlas->width * atlas->height);
+		// Streamed atlases never hold a whole channel in memory, so they may pack at a larger resolution.
+		pack_options.resolution = p_options.tile_output_path.is_empty() ? 8 * 1024 : STREAM_ATLAS_RESOLUTION;
+
+		// Unchanged inputs reuse the merged mesh of an earlier run, moved instances only have their vertices re-transformed.
+		// Streamed tiles live outside the cache and are always rebuilt.
+		const String cache_path = p_options.tile_output_path.is_empty() ? _get_merge_cache_path(mesh_items, pack_options, p_options) : String();
+		Ref<ArrayMesh> cached_mesh = _load_cached_merge(cache_path, mesh_items);
+		if (cached_mesh.is_valid()) {
+			print_line("Loaded merged mesh from cache: " + cache_path);
+			merged_items.append_array(mesh_items);
+			Node *output_node = _create_output_instance(cached_mesh, output_name);
+			p_root->add_child(output_node, true);
+			output_node->set_owner(p_root);
+			continue;
+		}
+
+		Vector<uint16_t> surface_material_ids;
+		MaterialRegistry material_cache;
+		map_surfaces_to_material_ids(mesh_items, _get_cache_dir(p_options), surface_material_ids, material_cache);
+		Vector<SurfaceSnapshot> surfaces;
+		snapshot_surfaces(mesh_items, surface_material_ids, surfaces);
+		Vector<Vector<Vector2> > uv_groups;
+		Vector<Vector<ModelVertex> > model_vertices;
+		write_uvs(surfaces, uv_groups, model_vertices);
+		LocalVector<bool> flat_materials;
+		flat_materials.resize(material_cache.size());
+		for (uint32_t material_i = 0; material_i < flat_materials.size(); material_i++) {
+			flat_materials[material_i] = _is_flat_color_material(material_cache.get(material_i));
+		}
+		xatlas::Atlas *generated_atlas = xatlas::Create();
+		xatlas::Atlas *atlas = generated_atlas;
+		AtlasLookupTiles atlas_lookup;
+		LocalVector<int32_t> atlas_surfaces;
+		// Edits that leave every chart input alone, such as material or vertex position changes, keep the packed layout and are only rasterized again.
+		// Any other edit may need more room for a chart, so it packs again.
+		const String layout_path = _get_layout_cache_path(surfaces, flat_materials, pack_options, p_options);
+		CachedAtlasLayout cached_layout;
+		if (_load_cached_layout(layout_path, surfaces, cached_layout, atlas_surfaces)) {
+			print_line("Reusing the chart layout from cache: " + layout_path);
+			atlas = &cached_layout.atlas;
+		} else {
+			Error err = _generate_atlas(surfaces, flat_materials, p_options, atlas, pack_options, atlas_surfaces);
+			if (err != OK) {
+				xatlas::Destroy(generated_atlas);
+				ERR_CONTINUE_MSG(true, vformat("Cannot generate the atlas of merge group %d.", items_i));
+			}
+			_save_cached_layout(layout_path, atlas, atlas_surfaces);
+		}
 		HashMap<String, Ref<Image> > texture_atlas;
 		HashMap<int32_t, MaterialImageCache> material_image_cache;
 		MergeState state{
 			root,
 			atlas,
 			mesh_items,
-			mesh_to_index_to_material,
+			surfaces,
 			uv_groups,
 			model_vertices,
-			root->get_name(),
+			output_name,
 			pack_options,
 			atlas_lookup,
 			material_cache,
 			texture_atlas,
 			material_image_cache,
+			p_options.tile_output_path,
+			HashMap<String, PackedStringArray>(),
+			atlas_surfaces,
+			LocalVector<Rect2i>(),
+			SourceImageCache(),
+			PackedVector3Array(),
+			PackedInt32Array(),
 		};
+		_layout_palette(state, flat_materials);
+		atlas_lookup.create(atlas->width, atlas->height);
 
 #ifdef TOOLS_ENABLED
-		EditorProgress progress_scene_merge("gen_get_source_material", TTR("Get source material"), state.material_cache.size());
+		EditorProgress *progress_scene_merge = nullptr;
+		if (EditorNode::get_singleton()) {
+			progress_scene_merge = memnew(EditorProgress("gen_get_source_material", TTR("Get source material"), state.material_cache.size()));
+		}
 		int step = 0;
 #endif
 
-		for (const Ref<Material> &abstract_material : state.material_cache) {
+		for (int32_t material_i = 0; material_i < state.material_cache.size(); material_i++) {
 #ifdef TOOLS_ENABLED
 			step++;
 #endif
-			Ref<BaseMaterial3D> material = abstract_material;
-			MaterialImageCache cache{
-				_get_source_texture(state, material),
-			};
-			int32_t material_i = state.material_cache.find(abstract_material);
-			state.material_image_cache[material_i == -1 ? state.material_image_cache.size() : material_i] = cache;
+			Ref<BaseMaterial3D> material = state.material_cache.get(material_i);
+			state.material_image_cache[material_i] = _get_source_textures(state, material);
 
 #ifdef TOOLS_ENABLED
-			progress_scene_merge.step(TTR("Getting Source Material: ") + material->get_name() + " (" + itos(step) + "/" + itos(state.material_cache.size()) + ")", step);
+			if (progress_scene_merge) {
+				progress_scene_merge->step(TTR("Getting Source Material: ") + material->get_name() + " (" + itos(step) + "/" + itos(state.material_cache.size()) + ")", step);
+			}
 #endif
 		}
+#ifdef TOOLS_ENABLED
+		if (progress_scene_merge) {
+			memdelete(progress_scene_merge);
+		}
+#endif
+		// Geometry is rasterized once, every channel is then gathered from the lookup.
+		_rasterize_atlas_lookup(state);
 		_generate_texture_atlas(state, "albedo");
-		Node *output_node = _output_mesh_atlas(state, p_index);
+		_generate_texture_atlas(state, "normal");
+		_generate_texture_atlas(state, "orm");
+		_generate_texture_atlas(state, "emission");
+		MeshInstance3D *output_node = _output_mesh_atlas(state, p_index);
+		if (!output_node) {
+			xatlas::Destroy(generated_atlas);
+			continue;
+		}
+		merged_items.append_array(mesh_items);
+		if (!cache_path.is_empty()) {
+			Array transforms;
+			for (const SurfaceSnapshot &surface : surfaces) {
+				transforms.push_back(surface.transform);
+			}
+			_save_cached_merge(cache_path, output_node->get_mesh(), state.output_local_vertices, state.output_vertex_surfaces, transforms);
+		}
 		p_root->add_child(output_node, true);
 		output_node->set_owner(p_root);
-		xatlas::Destroy(atlas);
+		xatlas::Destroy(generated_atlas);
 	}
+	_replace_mesh_instances(merged_items);
 	return p_root;
 }
 
-void MeshTextureAtlas::_generate_texture_atlas(MergeState &state, String texture_type) {
-#ifdef TOOLS_ENABLED
-	EditorProgress progress_texture_atlas("gen_mesh_atlas", TTR("Generate Atlas"), state.atlas->meshCount);
-	int step = 0;
-#endif
+bool MeshTextureAtlas::_is_flat_color_material(const Ref<BaseMaterial3D> &p_material) {
+	if (p_material.is_null() || p_material->get_texture(BaseMaterial3D::TEXTURE_ALBEDO).is_valid()) {
+		return false;
+	}
+	if (p_material->get_feature(BaseMaterial3D::FEATURE_NORMAL_MAPPING) && p_material->get_texture(BaseMaterial3D::TEXTURE_NORMAL).is_valid()) {
+		return false;
+	}
+	if (p_material->get_feature(BaseMaterial3D::FEATURE_EMISSION) && p_material->get_texture(BaseMaterial3D::TEXTURE_EMISSION).is_valid()) {
+		return false;
+	}
+	if (Object::cast_to<ORMMaterial3D>(p_material.ptr())) {
+		return p_material->get_texture(BaseMaterial3D::TEXTURE_ORM).is_null();
+	}
+	const bool has_ao_texture = p_material->get_feature(BaseMaterial3D::FEATURE_AMBIENT_OCCLUSION) && p_material->get_texture(BaseMaterial3D::TEXTURE_AMBIENT_OCCLUSION).is_valid();
+	return !has_ao_texture && p_material->get_texture(BaseMaterial3D::TEXTURE_ROUGHNESS).is_null() && p_material->get_texture(BaseMaterial3D::TEXTURE_METALLIC).is_null();
+}
+
+void MeshTextureAtlas::_layout_palette(MergeState &state, const LocalVector<bool> &p_flat_materials) {
+	state.palette_cells.resize(p_flat_materials.size());
+	int32_t cell_count = 0;
+	for (const SurfaceSnapshot &surface : state.surfaces) {
+		if (surface.material_id < p_flat_materials.size() && p_flat_materials[surface.material_id] && !state.palette_cells[surface.material_id].has_area()) {
+			state.palette_cells[surface.material_id].size = Size2i(PALETTE_CELL_SIZE, PALETTE_CELL_SIZE);
+			cell_count++;
+		}
+	}
+	if (cell_count == 0) {
+		return;
+	}
+	// The palette is appended below the packed charts, in rows as wide as the atlas.
+	// Its origin is aligned to the cell size, so no mip texel up to one texel per cell mixes two colours,
+	// and the uvs sample the cell centres, which bilinear filtering keeps inside the cell.
+	const int32_t row_cells = state.atlas->width > 0 ? MAX(1, int32_t(state.atlas->width) / PALETTE_CELL_SIZE) : MIN(cell_count, PALETTE_MAX_ROW_CELLS);
+	const Point2i origin(0, (int32_t(state.atlas->height) + PALETTE_CELL_SIZE - 1) / PALETTE_CELL_SIZE * PALETTE_CELL_SIZE);
+	int32_t cell_i = 0;
+	for (Rect2i &cell : state.palette_cells) {
+		if (!cell.has_area()) {
+			continue;
+		}
+		cell.position = origin + Point2i(cell_i % row_cells, cell_i / row_cells) * PALETTE_CELL_SIZE;
+		cell_i++;
+	}
+	state.atlas->width = MAX(state.atlas->width, uint32_t(row_cells * PALETTE_CELL_SIZE));
+	state.atlas->height = origin.y + ((cell_count + row_cells - 1) / row_cells) * PALETTE_CELL_SIZE;
+	print_verbose(vformat("Atlas palette: %d flat colour materials in %d rows", cell_count, (cell_count + row_cells - 1) / row_cells));
+}
+
+void MeshTextureAtlas::_rasterize_chart_task(void *p_userdata, uint32_t p_index) {
+	const ChartRasterizeData *data = static_cast<const ChartRasterizeData *>(p_userdata);
+	const ChartRasterizeData::Chart &task = data->charts[p_index];
+	const xatlas::Mesh &mesh = data->atlas->meshes[task.mesh_index];
+	const xatlas::Chart &chart = mesh.chartArray[task.chart_index];
+	const Size2i &source_size = data->source_sizes[chart.material];
+
 	AtlasTextureArguments args;
-	args.atlas_data = Image::create_empty(state.atlas->width, state.atlas->height, false, Image::FORMAT_RGBA8);
-	args.atlas_lookup = state.atlas_lookup.ptrw();
-	args.atlas_height = state.atlas->height;
-	args.atlas_width = state.atlas->width;
-	for (uint32_t mesh_i = 0; mesh_i < state.atlas->meshCount; mesh_i++) {
-		const xatlas::Mesh &mesh = state.atlas->meshes[mesh_i];
+	args.atlas_lookup = data->atlas_lookup;
+	args.atlas_width = data->atlas->width;
+	args.atlas_height = data->atlas->height;
+	args.source_width = source_size.width;
+	args.source_height = source_size.height;
+	args.material_index = (uint16_t)chart.material;
+	AtlasLookupSampler sampler{ &args };
+
+	const Vector<Vector2> &uvs = (*data->uvs)[data->atlas_surfaces[task.mesh_index]];
+	for (uint32_t face_i = 0; face_i < chart.faceCount; face_i++) {
+		Vector2 v[3];
+		for (uint32_t l = 0; l < 3; l++) {
+			const uint32_t index = mesh.indexArray[chart.faceArray[face_i] * 3 + l];
+			const xatlas::Vertex &vertex = mesh.vertexArray[index];
+			v[l] = Vector2(vertex.uv[0], vertex.uv[1]);
+			args.source_uvs[l] = uvs[vertex.xref];
+		}
+		MeshMergeTriangle tri(v[0], v[1], v[2], Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1));
+		tri.drawAA(sampler);
+	}
+}
+
+void MeshTextureAtlas::_rasterize_atlas_lookup(MergeState &state) {
+	// Every channel of a material shares the size of its albedo image, see _get_source_textures.
+	LocalVector<Size2i> source_sizes;
+	source_sizes.resize(state.material_cache.size());
+	for (uint32_t material_i = 0; material_i < source_sizes.size(); material_i++) {
+		if (!state.material_image_cache.has(material_i)) {
+			continue;
+		}
+		const Ref<Image> &img = state.material_image_cache[material_i].albedo_img;
+		if (img.is_valid() && !img->is_empty()) {
+			source_sizes[material_i] = img->get_size();
+		}
+	}
+
+	rasterize_charts(state.atlas, state.uvs, state.atlas_surfaces, source_sizes, true, state.atlas_lookup);
+
+	// Palette cells point at texel (0, 0) of a material without textures, so they resolve to its fallback colours.
+	for (uint32_t material_i = 0; material_i < state.palette_cells.size(); material_i++) {
+		const Rect2i &cell = state.palette_cells[material_i];
+		state.atlas_lookup.reserve(cell);
+		for (int32_t y = cell.position.y; y < cell.get_end().y; y++) {
+			for (int32_t x = cell.position.x; x < cell.get_end().x; x++) {
+				AtlasLookupTexel *texel = state.atlas_lookup.get_texel(x, y);
+				ERR_CONTINUE(!texel);
+				texel->material_index = material_i;
+			}
+		}
+	}
+	print_verbose(vformat("Atlas lookup tiles allocated: %d of %d", state.atlas_lookup.get_allocated_tile_count(), state.atlas_lookup.tiles.size()));
+}
+
+void MeshTextureAtlas::rasterize_charts(const xatlas::Atlas *p_atlas, const Vector<Vector<Vector2> > &p_uvs, const LocalVector<int32_t> &p_atlas_surfaces, const LocalVector<Size2i> &p_source_sizes, bool p_use_threads, AtlasLookupTiles &r_lookup) {
+	// Charts of one page never overlap, so each one is rasterized by its own task.
+	// Pages would share the lookup texels and race, see _generate_atlas.
+	ERR_FAIL_COND_MSG(p_atlas->atlasCount > 1, "Cannot rasterize an atlas with more than one page.");
+	// The lookup tiles under every chart are reserved here, before any task writes to them.
+	LocalVector<ChartRasterizeData::Chart> charts;
+	for (uint32_t mesh_i = 0; mesh_i < p_atlas->meshCount; mesh_i++) {
+		const xatlas::Mesh &mesh = p_atlas->meshes[mesh_i];
 		for (uint32_t chart_i = 0; chart_i < mesh.chartCount; chart_i++) {
 			const xatlas::Chart &chart = mesh.chartArray[chart_i];
-			Ref<Image> img;
-			if (texture_type == "albedo") {
-				img = state.material_image_cache[chart.material].albedo_img;
-			} else {
-				ERR_PRINT("Unknown texture type: " + texture_type);
+			if (chart.faceCount == 0 || chart.material >= p_source_sizes.size() || p_source_sizes[chart.material].width == 0 || p_source_sizes[chart.material].height == 0) {
 				continue;
 			}
-			ERR_CONTINUE(img.is_null());
-			ERR_CONTINUE(img->is_empty());
-			ERR_CONTINUE_MSG(Image::get_format_pixel_size(img->get_format()) > 4, "Float textures are not supported yet for texture type: " + texture_type);
-
-			img->convert(Image::FORMAT_RGBA8);
-			args.source_texture = img;
-			args.material_index = (uint16_t)chart.material;
-
+			Rect2 bounds;
 			for (uint32_t face_i = 0; face_i < chart.faceCount; face_i++) {
-				Vector2 v[3];
 				for (uint32_t l = 0; l < 3; l++) {
-					const uint32_t index = mesh.indexArray[chart.faceArray[face_i] * 3 + l];
-					const xatlas::Vertex &vertex = mesh.vertexArray[index];
-					v[l] = Vector2(vertex.uv[0], vertex.uv[1]);
-					args.source_uvs[l].x = state.uvs[mesh_i][vertex.xref].x / img->get_width();
-					args.source_uvs[l].y = state.uvs[mesh_i][vertex.xref].y / img->get_height();
+					const xatlas::Vertex &vertex = mesh.vertexArray[mesh.indexArray[chart.faceArray[face_i] * 3 + l]];
+					const Vector2 uv(vertex.uv[0], vertex.uv[1]);
+					if (face_i == 0 && l == 0) {
+						bounds.position = uv;
+					} else {
+						bounds.expand_to(uv);
+					}
 				}
-				MeshMergeTriangle tri(v[0], v[1], v[2], Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1));
-
-				tri.drawAA(set_atlas_texel, &args);
 			}
+			// One texel of margin covers pixels the anti-aliased edges touch.
+			const Point2i begin = Point2i(bounds.position.floor()) - Point2i(1, 1);
+			const Point2i end = Point2i(bounds.get_end().ceil()) + Point2i(2, 2);
+			r_lookup.reserve(Rect2i(begin, end - begin));
+			charts.push_back({ mesh_i, chart_i });
+		}
+	}
+
+	ChartRasterizeData data;
+	data.atlas = p_atlas;
+	data.atlas_lookup = &r_lookup;
+	data.uvs = &p_uvs;
+	data.atlas_surfaces = p_atlas_surfaces.ptr();
+	data.source_sizes = p_source_sizes.ptr();
+	data.charts = charts.ptr();
+	if (!p_use_threads) {
+		for (uint32_t chart_i = 0; chart_i < charts.size(); chart_i++) {
+			_rasterize_chart_task(&data, chart_i);
 		}
+		return;
+	}
+
+	WorkerThreadPool::GroupID group_task = WorkerThreadPool::get_singleton()->add_native_group_task(&_rasterize_chart_task, &data, charts.size(), -1, true, "SceneMergeRasterizeCharts");
 #ifdef TOOLS_ENABLED
-		progress_texture_atlas.step(TTR("Process Mesh for Atlas: ") + texture_type + " (" + itos(step) + "/" + itos(state.atlas->meshCount) + ")", step);
-		step++;
+	// Headless merges, such as the tests, have no editor to report progress to.
+	if (EditorNode::get_singleton()) {
+		EditorProgress progress_texture_atlas("gen_mesh_atlas", TTR("Generate Atlas"), charts.size());
+		while (!WorkerThreadPool::get_singleton()->is_group_task_completed(group_task)) {
+			OS::get_singleton()->delay_usec(10000);
+			const uint32_t step = WorkerThreadPool::get_singleton()->get_group_processed_element_count(group_task);
+			progress_texture_atlas.step(TTR("Rasterizing Charts: ") + "(" + itos(step) + "/" + itos(charts.size()) + ")", step);
+		}
+	}
 #endif
+	WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_task);
+}
+
+void MeshTextureAtlas::_resolve_channel_row_task(void *p_userdata, uint32_t p_row) {
+	const ChannelResolveData *data = static_cast<const ChannelResolveData *>(p_userdata);
+	const AtlasLookupTiles &lookup = *data->lookup;
+	const uint32_t y = data->region.position.y + p_row;
+	const uint32_t region_begin = data->region.position.x;
+	const uint32_t region_end = data->region.get_end().x;
+	uint8_t *texels = data->texels + p_row * data->region.size.x * 4;
+	for (uint32_t tile_x = region_begin >> AtlasLookupTiles::TILE_SHIFT; tile_x <= (region_end - 1) >> AtlasLookupTiles::TILE_SHIFT; tile_x++) {
+		const AtlasLookupTexel *tile_row = lookup.get_tile_row(tile_x, y);
+		if (!tile_row) {
+			continue;
+		}
+		const uint32_t tile_begin = tile_x * AtlasLookupTiles::TILE_SIZE;
+		const uint32_t begin = MAX(tile_begin, region_begin);
+		const uint32_t end = MIN(tile_begin + AtlasLookupTiles::TILE_SIZE, region_end);
+		for (uint32_t x = begin; x < end; x++) {
+			const AtlasLookupTexel &texel = tile_row[x - tile_begin];
+			if (texel.material_index >= data->source_count) {
+				continue;
+			}
+			const AtlasChannelSource &source = data->sources[texel.material_index];
+			const uint8_t *source_texel = source.fallback;
+			if (source.texels && texel.x < source.width && texel.y < source.height) {
+				source_texel = source.texels + (texel.y * source.width + texel.x) * 4;
+			}
+			uint8_t *target = texels + (x - region_begin) * 4;
+			memcpy(target, source_texel, 4);
+			if (data->opaque) {
+				target[3] = 255;
+			}
+		}
 	}
-	print_line(vformat("Generated atlas for %s: width=%d, height=%d", texture_type, args.atlas_data->get_width(), args.atlas_data->get_height()));
-	args.atlas_data->generate_mipmaps();
-	state.texture_atlas.insert(texture_type, args.atlas_data);
 }
 
-Ref<Image> MeshTextureAtlas::_get_source_texture(MergeState &state, Ref<BaseMaterial3D> material) {
-	int32_t width = 0, height = 0;
-	Vector<Ref<Texture2D> > textures = { material->get_texture(BaseMaterial3D::TEXTURE_ALBEDO) };
-	Vector<Ref<Image> > images;
-	images.resize(textures.size());
+void MeshTextureAtlas::resolve_atlas_channel(const AtlasLookupTiles &p_lookup, const AtlasChannelSource *p_sources, uint32_t p_source_count, bool p_opaque, uint8_t *r_texels) {
+	resolve_atlas_channel_region(p_lookup, p_sources, p_source_count, p_opaque, Rect2i(0, 0, p_lookup.width, p_lookup.height), r_texels);
+}
+
+void MeshTextureAtlas::resolve_atlas_channel_region(const AtlasLookupTiles &p_lookup, const AtlasChannelSource *p_sources, uint32_t p_source_count, bool p_opaque, const Rect2i &p_region, uint8_t *r_texels) {
+	ERR_FAIL_NULL(r_texels);
+	ERR_FAIL_COND(!Rect2i(0, 0, p_lookup.width, p_lookup.height).encloses(p_region));
+	if (!p_region.has_area()) {
+		return;
+	}
+	ChannelResolveData data;
+	data.lookup = &p_lookup;
+	data.sources = p_sources;
+	data.source_count = p_source_count;
+	data.opaque = p_opaque;
+	data.region = p_region;
+	data.texels = r_texels;
+	// Rows only read the lookup and write their own texels, so they resolve independently.
+	WorkerThreadPool::GroupID group_task = WorkerThreadPool::get_singleton()->add_native_group_task(&_resolve_channel_row_task, &data, p_region.size.y, -1, true, "SceneMergeResolveChannel");
+	WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_task);
+}
+
+void MeshTextureAtlas::_generate_texture_atlas(MergeState &state, String texture_type) {
+	LocalVector<AtlasChannelSource> sources;
+	sources.resize(state.material_cache.size());
+	bool has_channel = texture_type == "albedo";
+	for (uint32_t material_i = 0; material_i < sources.size(); material_i++) {
+		if (!state.material_image_cache.has(material_i)) {
+			continue;
+		}
+		const MaterialImageCache &cache = state.material_image_cache[material_i];
+		Ref<Image> img;
+		Color fallback;
+		Color neutral;
+		if (texture_type == "albedo") {
+			img = cache.albedo_img;
+			fallback = cache.albedo_color;
+		} else if (texture_type == "normal") {
+			img = cache.normal_img;
+			fallback = cache.normal_color;
+			neutral = MaterialImageCache().normal_color;
+		} else if (texture_type == "orm") {
+			img = cache.orm_img;
+			fallback = cache.orm_color;
+			neutral = MaterialImageCache().orm_color;
+		} else if (texture_type == "emission") {
+			img = cache.emission_img;
+			fallback = cache.emission_color;
+			neutral = MaterialImageCache().emission_color;
+		} else {
+			ERR_FAIL_MSG("Unknown texture type: " + texture_type);
+		}
+		AtlasChannelSource &source = sources[material_i];
+		source.fallback[0] = fallback.get_r8();
+		source.fallback[1] = fallback.get_g8();
+		source.fallback[2] = fallback.get_b8();
+		source.fallback[3] = fallback.get_a8();
+		if (img.is_null() || img->is_empty()) {
+			has_channel = has_channel || fallback != neutral;
+			continue;
+		}
+		ERR_CONTINUE_MSG(img->get_format() != Image::FORMAT_RGBA8, "Source images must be RGBA8 for texture type: " + texture_type);
+		source.texels = img->ptr();
+		source.width = img->get_width();
+		source.height = img->get_height();
+		has_channel = true;
+	}
+	// Channels no material uses keep the defaults of the output material.
+	if (!has_channel) {
+		return;
+	}
+	if (!state.tile_output_path.is_empty()) {
+		_stream_texture_atlas(state, texture_type, sources);
+		return;
+	}
+
+	Ref<Image> atlas_data = Image::create_empty(state.atlas->width, state.atlas->height, false, Image::FORMAT_RGBA8);
+	resolve_atlas_channel(state.atlas_lookup, sources.ptr(), sources.size(), _is_opaque_atlas_channel(state, texture_type), atlas_data->ptrw());
 
-	for (int i = 0; i < textures.size(); ++i) {
-		if (textures[i].is_valid()) {
-			images.write[i] = textures[i]->get_image();
-			if (images[i].is_valid() && !images[i]->is_empty()) {
-				width = MAX(width, images[i]->get_width());
-				height = MAX(height, images[i]->get_height());
+	print_line(vformat("Generated atlas for %s: width=%d, height=%d", texture_type, atlas_data->get_width(), atlas_data->get_height()));
+	state.texture_atlas.insert(texture_type, atlas_data);
+}
+
+void MeshTextureAtlas::_stream_texture_atlas(MergeState &state, const String &texture_type, const LocalVector<AtlasChannelSource> &sources) {
+	Error err = DirAccess::make_dir_recursive_absolute(state.tile_output_path);
+	ERR_FAIL_COND_MSG(err != OK && err != ERR_ALREADY_EXISTS, "Cannot create the atlas tile directory: " + state.tile_output_path);
+	const AtlasLookupTiles &lookup = state.atlas_lookup;
+	const Rect2i atlas_rect(0, 0, lookup.width, lookup.height);
+	const uint32_t tiles_x = (lookup.width + STREAM_TILE_SIZE - 1) / STREAM_TILE_SIZE;
+	const uint32_t tiles_y = (lookup.height + STREAM_TILE_SIZE - 1) / STREAM_TILE_SIZE;
+	const String file_prefix = String(state.p_name).validate_filename() + "_" + texture_type;
+	// Same as the in-memory path, the albedo of transparent groups keeps the alpha of its sources.
+	const bool opaque = _is_opaque_atlas_channel(state, texture_type);
+
+	// One scratch buffer holds a tile and its apron at a time, so memory stays fixed whatever the atlas size.
+	const uint32_t scratch_size = STREAM_TILE_SIZE + STREAM_TILE_APRON * 2;
+	LocalVector<uint8_t> scratch;
+	scratch.resize(scratch_size * scratch_size * 4);
+	PackedStringArray paths;
+	for (uint32_t tile_y = 0; tile_y < tiles_y; tile_y++) {
+		for (uint32_t tile_x = 0; tile_x < tiles_x; tile_x++) {
+			const Rect2i tile_rect = Rect2i(tile_x * STREAM_TILE_SIZE, tile_y * STREAM_TILE_SIZE, STREAM_TILE_SIZE, STREAM_TILE_SIZE).intersection(atlas_rect);
+			const Rect2i region = tile_rect.grow(STREAM_TILE_APRON).intersection(atlas_rect);
+			// Tiles no chart reaches stay empty and are not written.
+			if (!lookup.has_allocated_tiles(region)) {
+				continue;
+			}
+			memset(scratch.ptr(), 0, region.size.x * region.size.y * 4);
+			resolve_atlas_channel_region(lookup, sources.ptr(), sources.size(), opaque, region, scratch.ptr());
+			// The apron lets texels near the tile border bleed from charts in the neighbouring tiles.
+			bleed_texels(scratch.ptr(), region.size.x, region.size.y);
+
+			Vector<uint8_t> tile_texels;
+			tile_texels.resize(tile_rect.size.x * tile_rect.size.y * 4);
+			uint8_t *tile_w = tile_texels.ptrw();
+			const Point2i offset = tile_rect.position - region.position;
+			for (int32_t y = 0; y < tile_rect.size.y; y++) {
+				memcpy(tile_w + y * tile_rect.size.x * 4, scratch.ptr() + ((offset.y + y) * region.size.x + offset.x) * 4, tile_rect.size.x * 4);
+			}
+			if (opaque) {
+				for (int32_t i = 0; i < tile_rect.size.x * tile_rect.size.y; i++) {
+					tile_w[i * 4 + 3] = 255;
+				}
 			}
+			Ref<Image> tile = Image::create_from_data(tile_rect.size.x, tile_rect.size.y, false, Image::FORMAT_RGBA8, tile_texels);
+			// Every tile builds its own mipmaps, they do not blend across tile borders.
+			tile->generate_mipmaps();
+			const String path = state.tile_output_path.path_join(vformat("%s_%d_%d.res", file_prefix, tile_x, tile_y));
+			err = ResourceSaver::save(tile, path);
+			ERR_CONTINUE_MSG(err != OK, "Cannot save the atlas tile: " + path);
+			paths.push_back(path);
 		}
 	}
+	print_line(vformat("Streamed atlas for %s: width=%d, height=%d, tiles=%d", texture_type, lookup.width, lookup.height, paths.size()));
+	state.texture_atlas_tiles.insert(texture_type, paths);
+}
+
+static Ref<Image> _load_source_image(const Ref<Texture2D> &p_texture) {
+	if (p_texture.is_null()) {
+		return Ref<Image>();
+	}
+	Ref<Image> image = p_texture->get_image();
+	if (image.is_null() || image->is_empty()) {
+		return Ref<Image>();
+	}
+	if (image->is_compressed()) {
+		image->decompress();
+	}
+	return image;
+}
 
-	for (int i = 0; i < images.size(); ++i) {
-		if (images[i].is_valid()) {
-			if (!images[i]->is_empty() && images[i]->is_compressed()) {
-				images.write[i]->decompress();
+int32_t MeshTextureAtlas::SourceImageCache::get_texture_image(const Ref<Texture2D> &p_texture) {
+	if (p_texture.is_null()) {
+		return -1;
+	}
+	HashMap<ObjectID, int32_t>::ConstIterator E = textures.find(p_texture->get_instance_id());
+	if (E) {
+		return E->value;
+	}
+	int32_t index = -1;
+	const Ref<Image> image = _load_source_image(p_texture);
+	if (image.is_valid()) {
+		const Vector<uint8_t> data = image->get_data();
+		LocalVector<int32_t> &candidates = contents[hash_murmur3_buffer(data.ptr(), data.size())];
+		for (int32_t candidate : candidates) {
+			const Ref<Image> &other = images[candidate];
+			if (other->get_size() == image->get_size() && other->get_format() == image->get_format() && other->get_data().size() == data.size() && memcmp(other->ptr(), data.ptr(), data.size()) == 0) {
+				index = candidate;
+				break;
 			}
-			images.write[i]->resize(width, height, Image::INTERPOLATE_LANCZOS);
 		}
+		if (index < 0) {
+			index = images.size();
+			images.push_back(image);
+			candidates.push_back(index);
+		}
+	}
+	textures.insert(p_texture->get_instance_id(), index);
+	return index;
+}
+
+int32_t MeshTextureAtlas::SourceImageCache::get_resized_image(int32_t p_image, int32_t p_width, int32_t p_height) {
+	ERR_FAIL_INDEX_V(p_image, int32_t(images.size()), -1);
+	ERR_FAIL_COND_V(p_width <= 0 || p_width > UINT16_MAX || p_height <= 0 || p_height > UINT16_MAX, -1);
+	const Ref<Image> &image = images[p_image];
+	if (image->get_width() == p_width && image->get_height() == p_height && image->get_format() == Image::FORMAT_RGBA8) {
+		return p_image;
+	}
+	const uint64_t key = (uint64_t(p_image) << 32) | (uint64_t(p_width) << 16) | uint64_t(p_height);
+	HashMap<uint64_t, int32_t>::ConstIterator E = resized.find(key);
+	if (E) {
+		return E->value;
+	}
+	// Cached images are shared, so the resize works on a copy.
+	Ref<Image> copy = image->duplicate();
+	if (copy->get_width() != p_width || copy->get_height() != p_height) {
+		copy->resize(p_width, p_height, Image::INTERPOLATE_LANCZOS);
 	}
+	copy->convert(Image::FORMAT_RGBA8);
+	const int32_t index = images.size();
+	images.push_back(copy);
+	resized.insert(key, index);
+	return index;
+}
+
+Ref<Image> MeshTextureAtlas::SourceImageCache::get_tinted_image(int32_t p_image, const Color &p_tint) {
+	ERR_FAIL_INDEX_V(p_image, int32_t(images.size()), Ref<Image>());
+	const uint64_t key = (uint64_t(p_image) << 32) | p_tint.clamp().to_rgba32();
+	HashMap<uint64_t, Ref<Image> >::ConstIterator E = tinted.find(key);
+	if (E) {
+		return E->value;
+	}
+	const Ref<Image> &image = images[p_image];
+	ERR_FAIL_COND_V(image->get_format() != Image::FORMAT_RGBA8, Ref<Image>());
+	Ref<Image> tinted_image = Image::create_empty(image->get_width(), image->get_height(), false, Image::FORMAT_RGBA8);
+	tint_texels(image->ptr(), tinted_image->ptrw(), image->get_width(), image->get_height(), p_tint);
+	tinted.insert(key, tinted_image);
+	return tinted_image;
+}
 
-	Ref<Image> img = Image::create_empty(width, height, false, Image::FORMAT_RGBA8);
+static uint8_t _get_texel_channel(const uint8_t *p_texel, BaseMaterial3D::TextureChannel p_channel) {
+	if (p_channel == BaseMaterial3D::TEXTURE_CHANNEL_GRAYSCALE) {
+		return (p_texel[0] + p_texel[1] + p_texel[2]) / 3;
+	}
+	return p_texel[p_channel];
+}
 
-	bool has_albedo_texture = images[0].is_valid() && !images[0]->is_empty();
-	Color color_mul = has_albedo_texture ? material->get_albedo() : Color(0, 0, 0, 0);
-	Color color_add = has_albedo_texture ? Color(0, 0, 0, 0) : material->get_albedo();
-	for (int32_t y = 0; y < img->get_height(); y++) {
-		for (int32_t x = 0; x < img->get_width(); x++) {
-			Color c = has_albedo_texture ? images[0]->get_pixel(x, y) : Color();
-			c *= color_mul;
-			c += color_add;
-			img->set_pixel(x, y, c);
+static void _tint_texel_row(const uint8_t *p_source, uint8_t *r_texels, int32_t p_width, const uint8_t *p_tint) {
+	int32_t x = 0;
+#ifdef MESH_TEXTURE_ATLAS_SSE2
+	// Four texels at a time in 16-bit lanes, t * m / 255 rounded as (v + (v >> 8)) >> 8 with v = t * m + 128.
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(128);
+	const __m128i tint = _mm_setr_epi16(p_tint[0], p_tint[1], p_tint[2], p_tint[3], p_tint[0], p_tint[1], p_tint[2], p_tint[3]);
+	for (; x + 4 <= p_width; x += 4) {
+		const __m128i texels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p_source + x * 4));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(texels, zero), tint), half);
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(texels, zero), tint), half);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(r_texels + x * 4), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; x < p_width; x++) {
+		for (int32_t channel = 0; channel < 4; channel++) {
+			const uint32_t value = p_source[x * 4 + channel] * p_tint[channel] + 128;
+			r_texels[x * 4 + channel] = uint8_t((value + (value >> 8)) >> 8);
 		}
 	}
+}
 
-	return img;
+void MeshTextureAtlas::_tint_row_task(void *p_userdata, uint32_t p_row) {
+	const TintData *data = static_cast<const TintData *>(p_userdata);
+	const int64_t offset = int64_t(p_row) * data->width * 4;
+	_tint_texel_row(data->source + offset, data->texels + offset, data->width, data->tint);
 }
 
-Error MeshTextureAtlas::_generate_atlas(const int32_t p_num_meshes, Vector<Vector<Vector2> > &r_uvs, xatlas::Atlas *r_atlas, const Vector<MeshState> &r_meshes, const Vector<Ref<Material> > p_material_cache,
-		xatlas::PackOptions &r_pack_options) {
-	if (r_meshes.is_empty()) {
-		return ERR_SKIP;
+void MeshTextureAtlas::tint_texels(const uint8_t *p_source, uint8_t *r_texels, int32_t p_width, int32_t p_height, const Color &p_tint) {
+	ERR_FAIL_NULL(p_source);
+	ERR_FAIL_NULL(r_texels);
+	TintData data;
+	data.source = p_source;
+	data.texels = r_texels;
+	data.width = p_width;
+	const Color tint = p_tint.clamp();
+	data.tint[0] = tint.get_r8();
+	data.tint[1] = tint.get_g8();
+	data.tint[2] = tint.get_b8();
+	data.tint[3] = tint.get_a8();
+	WorkerThreadPool::GroupID group_task = WorkerThreadPool::get_singleton()->add_native_group_task(&_tint_row_task, &data, p_height, -1, true, "SceneMergeTintTexels");
+	WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_task);
+}
+
+void MeshTextureAtlas::_bake_emission_row_task(void *p_userdata, uint32_t p_row) {
+	const EmissionBakeData *data = static_cast<const EmissionBakeData *>(p_userdata);
+	const int64_t offset = int64_t(p_row) * data->width * 4;
+	const uint8_t *source = data->source + offset;
+	uint8_t *texels = data->texels + offset;
+	for (int32_t x = 0; x < data->width; x++) {
+		texels[x * 4 + 0] = data->table[0][source[x * 4 + 0]];
+		texels[x * 4 + 1] = data->table[1][source[x * 4 + 1]];
+		texels[x * 4 + 2] = data->table[2][source[x * 4 + 2]];
+		texels[x * 4 + 3] = 255;
 	}
-	for (int32_t mesh_i = 0; mesh_i < r_meshes.size(); mesh_i++) {
-		for (int32_t j = 0; j < r_meshes[mesh_i].mesh->get_surface_count(); j++) {
-			Array mesh = r_meshes[mesh_i].mesh->surface_get_arrays(j);
-			Array indices = mesh[ArrayMesh::ARRAY_INDEX];
-			xatlas::UvMeshDecl mesh_declaration;
-			mesh_declaration.vertexCount = PackedVector3Array(mesh[Mesh::ARRAY_VERTEX]).size();
-
-			PackedVector2Array original_data = PackedVector2Array(mesh[Mesh::ARRAY_TEX_UV2]);
-
-			PackedFloat32Array float_data;
-			float_data.resize(original_data.size() * 2);
-
-			for (int i = 0; i < original_data.size(); ++i) {
-				Vector2 vertex = original_data[i];
-				float_data.set(i * 2 + 0, static_cast<float>(vertex.x));
-				float_data.set(i * 2 + 1, static_cast<float>(vertex.y));
-			}
-
-			mesh_declaration.vertexUvData = float_data.ptr();
-			mesh_declaration.vertexStride = sizeof(float) * 2;
-			mesh_declaration.indexFormat = xatlas::IndexFormat::UInt32;
-			Vector<int32_t> mesh_indices = mesh[Mesh::ARRAY_INDEX];
-			Vector<uint32_t> indexes;
-			indexes.resize(mesh_indices.size());
-			Vector<uint32_t> materials;
-			materials.resize(mesh_indices.size());
-			for (int32_t index_i = 0; index_i < mesh_indices.size(); index_i++) {
-				indexes.write[index_i] = mesh_indices[index_i];
-			}
-			for (int32_t index_i = 0; index_i < mesh_indices.size(); index_i++) {
-				Ref<Material> mat = r_meshes[mesh_i].mesh_instance->get_active_material(j);
-				int32_t material_i = p_material_cache.find(mat);
-				materials.write[index_i] = material_i;
-			}
-			mesh_declaration.indexCount = indexes.size();
-			mesh_declaration.indexData = indexes.ptr();
-			mesh_declaration.faceMaterialData = materials.ptr();
-			xatlas::AddMeshError error = xatlas::AddUvMesh(r_atlas, mesh_declaration);
-			print_verbose(vformat("Adding mesh %d: %s", mesh_i, xatlas::StringForEnum(error)));
-		}
-	}
-	xatlas::ChartOptions chart_options;
-	chart_options.useInputMeshUvs = true;
-	chart_options.fixWinding = true;
-	xatlas::Generate(r_atlas, chart_options, r_pack_options);
-	return OK;
 }
 
-void MeshTextureAtlas::write_uvs(const Vector<MeshState> &p_mesh_items, Vector<Vector<Vector2> > &uv_groups, Array &r_mesh_to_index_to_material, Vector<Vector<ModelVertex> > &r_model_vertices) {
-	int32_t total_surface_count = 0;
-	for (int32_t mesh_i = 0; mesh_i < p_mesh_items.size(); mesh_i++) {
-		total_surface_count += p_mesh_items[mesh_i].mesh->get_surface_count();
+void MeshTextureAtlas::bake_emission_texels(const uint8_t *p_source, uint8_t *r_texels, int32_t p_width, int32_t p_height, const Color &p_emission, float p_energy, bool p_multiply) {
+	ERR_FAIL_NULL(p_source);
+	ERR_FAIL_NULL(r_texels);
+	EmissionBakeData data;
+	data.source = p_source;
+	data.texels = r_texels;
+	data.width = p_width;
+	// A texel only has 256 values per channel, so the float math runs once per value instead of once per texel.
+	const float energy = MAX(p_energy, 0.0f);
+	const float emission[3] = { MAX(p_emission.r, 0.0f), MAX(p_emission.g, 0.0f), MAX(p_emission.b, 0.0f) };
+	for (int32_t channel = 0; channel < 3; channel++) {
+		for (int32_t value = 0; value < 256; value++) {
+			const float texel = value / 255.0f;
+			const float baked = (p_multiply ? texel * emission[channel] : texel + emission[channel]) * energy;
+			data.table[channel][value] = uint8_t(CLAMP(baked, 0.0f, 1.0f) * 255.0f + 0.5f);
+		}
 	}
-	r_model_vertices.resize(total_surface_count);
-	uv_groups.resize(total_surface_count);
+	WorkerThreadPool::GroupID group_task = WorkerThreadPool::get_singleton()->add_native_group_task(&_bake_emission_row_task, &data, p_height, -1, true, "SceneMergeBakeEmission");
+	WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_task);
+}
 
-	int32_t mesh_count = 0;
-	for (int32_t mesh_i = 0; mesh_i < p_mesh_items.size(); mesh_i++) {
-		for (int32_t surface_i = 0; surface_i < p_mesh_items[mesh_i].mesh->get_surface_count(); surface_i++) {
-			Ref<ArrayMesh> array_mesh = p_mesh_items[mesh_i].mesh;
-			Array mesh = array_mesh->surface_get_arrays(surface_i);
-			Vector<ModelVertex> model_vertices;
-			Vector<Vector3> vertex_arr = mesh[Mesh::ARRAY_VERTEX];
-			Vector<Vector3> normal_arr = mesh[Mesh::ARRAY_NORMAL];
-			Vector<Vector2> uv_arr = mesh[Mesh::ARRAY_TEX_UV];
-			Vector<int32_t> index_arr = mesh[Mesh::ARRAY_INDEX];
-			Vector<Plane> tangent_arr = mesh[Mesh::ARRAY_TANGENT];
-			Transform3D transform = p_mesh_items[mesh_i].mesh_instance->get_transform();
-			Node3D *parent_node = Node3D::cast_to<Node3D>(p_mesh_items[mesh_i].mesh_instance->get_parent());
-			for (; parent_node != nullptr; parent_node = Node3D::cast_to<Node3D>(parent_node->get_parent())) {
-				transform = parent_node->get_transform() * transform;
-			}
-			if (!vertex_arr.is_empty()) {
-				model_vertices.resize(vertex_arr.size());
-			}
-
-			model_vertices.resize(vertex_arr.size());
-			Vector<Vector2> uvs;
-			uvs.resize(vertex_arr.size());
-			for (int32_t vertex_i = 0; vertex_i < vertex_arr.size(); vertex_i++) {
-				ModelVertex vertex_attributes;
-				vertex_attributes.pos = transform.xform(vertex_arr[vertex_i]);
-				ERR_BREAK(normal_arr.is_empty());
-				vertex_attributes.normal = normal_arr[vertex_i];
-				vertex_attributes.normal.normalize();
-				if (vertex_attributes.normal.length_squared() < CMP_EPSILON) {
-					vertex_attributes.normal = Vector3(0, 1, 0);
-				}
-				model_vertices.write[vertex_i] = vertex_attributes;
-				ERR_BREAK(r_mesh_to_index_to_material.is_empty());
-				Array index_to_material = r_mesh_to_index_to_material[mesh_count];
-				int32_t index = index_arr.find(vertex_i);
-				ERR_CONTINUE(index == -1);
-
-				uvs.write[vertex_i] = uv_arr[vertex_i];
-
-				const Ref<Material> material = index_to_material.get(index);
-				Ref<BaseMaterial3D> Node3D_material = material;
-				const Ref<Texture2D> tex = Node3D_material->get_texture(BaseMaterial3D::TextureParam::TEXTURE_ALBEDO);
-				if (tex.is_valid()) {
-					uvs.write[vertex_i].x *= tex->get_width();
-					uvs.write[vertex_i].y *= tex->get_height();
-				}
-			}
-			r_model_vertices.write[mesh_count] = model_vertices;
-			uv_groups.write[mesh_count] = uvs;
-			mesh_count++;
+MeshTextureAtlas::MaterialImageCache MeshTextureAtlas::_get_source_textures(MergeState &state, Ref<BaseMaterial3D> material) {
+	MaterialImageCache cache;
+	const bool orm_material = Object::cast_to<ORMMaterial3D>(material.ptr()) != nullptr;
+	const bool has_ao = material->get_feature(BaseMaterial3D::FEATURE_AMBIENT_OCCLUSION);
+	const bool has_emission = material->get_feature(BaseMaterial3D::FEATURE_EMISSION);
+
+	enum {
+		SOURCE_ALBEDO,
+		SOURCE_NORMAL,
+		SOURCE_ROUGHNESS,
+		SOURCE_METALLIC,
+		SOURCE_AO,
+		SOURCE_EMISSION,
+		SOURCE_MAX,
+	};
+	Ref<Texture2D> textures[SOURCE_MAX];
+	textures[SOURCE_ALBEDO] = material->get_texture(BaseMaterial3D::TEXTURE_ALBEDO);
+	if (material->get_feature(BaseMaterial3D::FEATURE_NORMAL_MAPPING)) {
+		textures[SOURCE_NORMAL] = material->get_texture(BaseMaterial3D::TEXTURE_NORMAL);
+	}
+	if (orm_material) {
+		textures[SOURCE_ROUGHNESS] = material->get_texture(BaseMaterial3D::TEXTURE_ORM);
+		textures[SOURCE_METALLIC] = textures[SOURCE_ROUGHNESS];
+		textures[SOURCE_AO] = has_ao ? textures[SOURCE_ROUGHNESS] : Ref<Texture2D>();
+	} else {
+		textures[SOURCE_ROUGHNESS] = material->get_texture(BaseMaterial3D::TEXTURE_ROUGHNESS);
+		textures[SOURCE_METALLIC] = material->get_texture(BaseMaterial3D::TEXTURE_METALLIC);
+		textures[SOURCE_AO] = has_ao ? material->get_texture(BaseMaterial3D::TEXTURE_AMBIENT_OCCLUSION) : Ref<Texture2D>();
+	}
+	if (has_emission) {
+		textures[SOURCE_EMISSION] = material->get_texture(BaseMaterial3D::TEXTURE_EMISSION);
+	}
+
+	// Every channel is resized to one size, so a single lookup texel addresses all of them.
+	int32_t width = 0, height = 0;
+	int32_t image_ids[SOURCE_MAX];
+	for (int i = 0; i < SOURCE_MAX; ++i) {
+		image_ids[i] = state.source_images.get_texture_image(textures[i]);
+		if (image_ids[i] >= 0) {
+			width = MAX(width, state.source_images.images[image_ids[i]]->get_width());
+			height = MAX(height, state.source_images.images[image_ids[i]]->get_height());
+		}
+	}
+	// A material without any texture still gets a one texel source, so its charts resolve to its colours.
+	width = MAX(width, 1);
+	height = MAX(height, 1);
+	Ref<Image> images[SOURCE_MAX];
+	for (int i = 0; i < SOURCE_MAX; ++i) {
+		if (image_ids[i] >= 0) {
+			image_ids[i] = state.source_images.get_resized_image(image_ids[i], width, height);
+		}
+		if (image_ids[i] >= 0) {
+			images[i] = state.source_images.images[image_ids[i]];
 		}
 	}
+
+	const Color albedo = material->get_albedo();
+	cache.albedo_color = albedo;
+	if (images[SOURCE_ALBEDO].is_null()) {
+		cache.albedo_img = Image::create_empty(width, height, false, Image::FORMAT_RGBA8);
+		cache.albedo_img->fill(albedo);
+	} else if (albedo.to_rgba32() == 0xFFFFFFFF) {
+		// A white tint leaves the texture unchanged, so it is used as is.
+		cache.albedo_img = images[SOURCE_ALBEDO];
+	} else {
+		cache.albedo_img = state.source_images.get_tinted_image(image_ids[SOURCE_ALBEDO], albedo);
+	}
+	cache.normal_img = images[SOURCE_NORMAL];
+
+	const float roughness = material->get_roughness();
+	const float metallic = material->get_metallic();
+	cache.orm_color = Color(1.0, roughness, metallic);
+	if (images[SOURCE_ROUGHNESS].is_valid() || images[SOURCE_METALLIC].is_valid() || images[SOURCE_AO].is_valid()) {
+		const BaseMaterial3D::TextureChannel roughness_channel = orm_material ? BaseMaterial3D::TEXTURE_CHANNEL_GREEN : material->get_roughness_texture_channel();
+		const BaseMaterial3D::TextureChannel metallic_channel = orm_material ? BaseMaterial3D::TEXTURE_CHANNEL_BLUE : material->get_metallic_texture_channel();
+		const BaseMaterial3D::TextureChannel ao_channel = orm_material ? BaseMaterial3D::TEXTURE_CHANNEL_RED : material->get_ao_texture_channel();
+		const uint8_t *roughness_texels = images[SOURCE_ROUGHNESS].is_valid() ? images[SOURCE_ROUGHNESS]->ptr() : nullptr;
+		const uint8_t *metallic_texels = images[SOURCE_METALLIC].is_valid() ? images[SOURCE_METALLIC]->ptr() : nullptr;
+		const uint8_t *ao_texels = images[SOURCE_AO].is_valid() ? images[SOURCE_AO]->ptr() : nullptr;
+		const uint8_t orm_fallback[3] = { 255, (uint8_t)cache.orm_color.get_g8(), (uint8_t)cache.orm_color.get_b8() };
+
+		// Packed like ORMMaterial3D, the scalar factors are baked in so the output material uses 1.0.
+		Ref<Image> orm = Image::create_empty(width, height, false, Image::FORMAT_RGBA8);
+		uint8_t *orm_texels = orm->ptrw();
+		for (int32_t i = 0; i < width * height; i++) {
+			const int32_t offset = i * 4;
+			orm_texels[offset + 0] = ao_texels ? _get_texel_channel(ao_texels + offset, ao_channel) : orm_fallback[0];
+			orm_texels[offset + 1] = roughness_texels ? (uint8_t)(_get_texel_channel(roughness_texels + offset, roughness_channel) * roughness + 0.5f) : orm_fallback[1];
+			orm_texels[offset + 2] = metallic_texels ? (uint8_t)(_get_texel_channel(metallic_texels + offset, metallic_channel) * metallic + 0.5f) : orm_fallback[2];
+			orm_texels[offset + 3] = 255;
+		}
+		cache.orm_img = orm;
+	}
+
+	if (has_emission) {
+		// RGBA8 cannot hold HDR emission, the energy multiplier is folded into the clamped colour.
+		const Color emission = material->get_emission();
+		const float energy = material->get_emission_energy_multiplier();
+		cache.emission_color = Color(emission.r * energy, emission.g * energy, emission.b * energy).clamp();
+		if (images[SOURCE_EMISSION].is_valid()) {
+			const bool multiply = material->get_emission_operator() == BaseMaterial3D::EMISSION_OP_MULTIPLY;
+			Ref<Image> emission_img = Image::create_empty(width, height, false, Image::FORMAT_RGBA8);
+			bake_emission_texels(images[SOURCE_EMISSION]->ptr(), emission_img->ptrw(), width, height, emission, energy, multiply);
+			cache.emission_img = emission_img;
+		}
+	}
+
+	return cache;
+}
+
+void MeshTextureAtlas::_uv_mesh_input_task(void *p_userdata, uint32_t p_index) {
+	UvMeshInputData *data = static_cast<UvMeshInputData *>(p_userdata);
+	const SurfaceSnapshot &surface = data->surfaces[data->atlas_surfaces[p_index]];
+
+	// Vector2 may hold doubles, xatlas expects packed floats.
+	LocalVector<float> &float_data = data->uv_data[p_index];
+	float_data.resize(surface.uv2s.size() * 2);
+	const Vector2 *uv2s = surface.uv2s.ptr();
+	for (int32_t i = 0; i < surface.uv2s.size(); ++i) {
+		float_data[i * 2 + 0] = static_cast<float>(uv2s[i].x);
+		float_data[i * 2 + 1] = static_cast<float>(uv2s[i].y);
+	}
+	// xatlas reads one material per face, all faces of a surface share its material id.
+	LocalVector<uint32_t> &materials = data->face_materials[p_index];
+	materials.resize(surface.indices.size() / 3);
+	for (uint32_t face_i = 0; face_i < materials.size(); face_i++) {
+		materials[face_i] = surface.material_id;
+	}
 }
 
-Ref<Image> MeshTextureAtlas::dilate_image(Ref<Image> source_image) {
-	Ref<Image> target_image = source_image->duplicate();
-	target_image->convert(Image::FORMAT_RGBA8);
-	LocalVector<uint8_t> pixels;
-	int32_t height = target_image->get_size().y;
-	int32_t width = target_image->get_size().x;
-	const int32_t bytes_in_pixel = 4;
-	pixels.resize(height * width * bytes_in_pixel);
-	for (int32_t y = 0; y < height; y++) {
-		for (int32_t x = 0; x < width; x++) {
-			int32_t pixel_index = x + (width * y);
-			int32_t index = pixel_index * bytes_in_pixel;
-			Color pixel = target_image->get_pixel(x, y);
-			pixels[index + 0] = uint8_t(pixel.r * 255.0f);
-			pixels[index + 1] = uint8_t(pixel.g * 255.0f);
-			pixels[index + 2] = uint8_t(pixel.b * 255.0f);
-			pixels[index + 3] = uint8_t(pixel.a * 255.0f);
+bool MeshTextureAtlas::_xatlas_progress(xatlas::ProgressCategory p_category, int p_progress, void *p_userdata) {
+	// xatlas serializes progress updates, so workers never report at the same time.
+	XatlasProgressData *data = static_cast<XatlasProgressData *>(p_userdata);
+	const int32_t category = int32_t(p_category);
+	ERR_FAIL_INDEX_V(category, XatlasProgressData::CATEGORY_COUNT, true);
+	if (p_progress == 0) {
+		data->begin_usec[category] = OS::get_singleton()->get_ticks_usec();
+	} else if (p_progress == 100) {
+		godot_xatlas_print("%s: %d ms", xatlas::StringForEnum(p_category), int((OS::get_singleton()->get_ticks_usec() - data->begin_usec[category]) / 1000));
+	}
+	return true;
+}
+
+Error MeshTextureAtlas::_generate_atlas(const Vector<SurfaceSnapshot> &p_surfaces, const LocalVector<bool> &p_flat_materials, const MergeOptions &p_options, xatlas::Atlas *r_atlas, xatlas::PackOptions &r_pack_options, LocalVector<int32_t> &r_atlas_surfaces) {
+	if (p_surfaces.is_empty()) {
+		return ERR_SKIP;
+	}
+	LocalVector<int32_t> input_surfaces;
+	for (int32_t surface_i = 0; surface_i < p_surfaces.size(); surface_i++) {
+		// Flat colour surfaces take no atlas area, their uvs point at a palette cell instead.
+		const uint16_t material_id = p_surfaces[surface_i].material_id;
+		if (material_id < p_flat_materials.size() && p_flat_materials[material_id]) {
+			continue;
 		}
+		// Meshes that could not be unwrapped, such as primitive meshes without uv2, have no chart uvs to pack.
+		if (p_surfaces[surface_i].uv2s.size() != p_surfaces[surface_i].vertices.size()) {
+			WARN_PRINT(vformat("Skipping merge surface %d, it has %d uv2s for %d vertices.", surface_i, p_surfaces[surface_i].uv2s.size(), p_surfaces[surface_i].vertices.size()));
+			continue;
+		}
+		input_surfaces.push_back(surface_i);
+	}
+	if (input_surfaces.is_empty()) {
+		return OK;
+	}
+
+	// Input buffers are converted concurrently, AddUvMesh itself must be called from one thread.
+	LocalVector<LocalVector<float> > uv_data;
+	LocalVector<LocalVector<uint32_t> > face_materials;
+	uv_data.resize(input_surfaces.size());
+	face_materials.resize(input_surfaces.size());
+	UvMeshInputData input_data;
+	input_data.surfaces = p_surfaces.ptr();
+	input_data.atlas_surfaces = input_surfaces.ptr();
+	input_data.uv_data = uv_data.ptr();
+	input_data.face_materials = face_materials.ptr();
+	WorkerThreadPool::GroupID group_task = WorkerThreadPool::get_singleton()->add_native_group_task(&_uv_mesh_input_task, &input_data, input_surfaces.size(), -1, true, "SceneMergeUvMeshInput");
+	WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_task);
+
+	XatlasProgressData progress_data;
+	xatlas::SetProgressCallback(r_atlas, &_xatlas_progress, &progress_data);
+	for (uint32_t input_i = 0; input_i < input_surfaces.size(); input_i++) {
+		const int32_t surface_i = input_surfaces[input_i];
+		const SurfaceSnapshot &surface = p_surfaces[surface_i];
+		xatlas::UvMeshDecl mesh_declaration;
+		mesh_declaration.vertexCount = surface.vertices.size();
+		mesh_declaration.vertexUvData = uv_data[input_i].ptr();
+		mesh_declaration.vertexStride = sizeof(float) * 2;
+		mesh_declaration.indexFormat = xatlas::IndexFormat::UInt32;
+		mesh_declaration.indexCount = surface.indices.size();
+		mesh_declaration.indexData = surface.indices.ptr();
+		mesh_declaration.faceMaterialData = face_materials[input_i].ptr();
+		xatlas::AddMeshError error = xatlas::AddUvMesh(r_atlas, mesh_declaration);
+		print_verbose(vformat("Adding mesh %d: %s", surface_i, xatlas::StringForEnum(error)));
+		if (error == xatlas::AddMeshError::Success) {
+			r_atlas_surfaces.push_back(surface_i);
+		}
+	}
+	if (!r_atlas_surfaces.is_empty()) {
+		xatlas::ChartOptions chart_options;
+		chart_options.useInputMeshUvs = true;
+		chart_options.fixWinding = true;
+		xatlas::ComputeCharts(r_atlas, chart_options);
+		_pack_charts(r_atlas, r_pack_options, p_options);
+	}
+	// The progress data lives on this stack frame.
+	xatlas::SetProgressCallback(r_atlas, nullptr, nullptr);
+	// The merged mesh samples one atlas texture, charts on a second page would overlap the first.
+	ERR_FAIL_COND_V_MSG(r_atlas->atlasCount > 1, ERR_CANT_CREATE, vformat("The charts need %d atlas pages at resolution %d, only one is supported.", r_atlas->atlasCount, r_pack_options.resolution));
+	return OK;
+}
+
+float MeshTextureAtlas::get_atlas_utilization(const xatlas::Atlas *p_atlas) {
+	ERR_FAIL_NULL_V(p_atlas, 0.0f);
+	if (p_atlas->atlasCount == 0 || !p_atlas->utilization) {
+		return 0.0f;
 	}
-	rjm_texbleed(pixels.ptr(), width, height, 3, bytes_in_pixel, bytes_in_pixel * width);
-	for (int32_t y = 0; y < height; y++) {
-		for (int32_t x = 0; x < width; x++) {
-			Color pixel;
-			int32_t pixel_index = x + (width * y);
-			int32_t index = bytes_in_pixel * pixel_index;
-			pixel.r = pixels[index + 0] / 255.0f;
-			pixel.g = pixels[index + 1] / 255.0f;
-			pixel.b = pixels[index + 2] / 255.0f;
-			pixel.a = 1.0f;
-			target_image->set_pixel(x, y, pixel);
+	float utilization = 0.0f;
+	for (uint32_t atlas_i = 0; atlas_i < p_atlas->atlasCount; atlas_i++) {
+		utilization += p_atlas->utilization[atlas_i];
+	}
+	return utilization / p_atlas->atlasCount;
+}
+
+void MeshTextureAtlas::_pack_charts(xatlas::Atlas *r_atlas, xatlas::PackOptions &r_pack_options, const MergeOptions &p_options) {
+	// Tiers from fastest to tightest, a tier only runs while the previous ones fell short of the target utilization.
+	struct PackTier {
+		const char *name;
+		bool brute_force;
+	};
+	const PackTier tiers[] = {
+		{ "fast", false },
+		{ "brute force", true },
+	};
+	int32_t best_tier = -1;
+	int32_t packed_tier = -1;
+	float best_utilization = -1.0f;
+	for (int32_t tier_i = 0; tier_i < int32_t(sizeof(tiers) / sizeof(tiers[0])); tier_i++) {
+		if (tiers[tier_i].brute_force && !p_options.brute_force_packing) {
+			break;
+		}
+		r_pack_options.bruteForce = tiers[tier_i].brute_force;
+		const uint64_t begin = OS::get_singleton()->get_ticks_usec();
+		xatlas::PackCharts(r_atlas, r_pack_options);
+		const uint64_t usec = OS::get_singleton()->get_ticks_usec() - begin;
+		packed_tier = tier_i;
+		const float utilization = get_atlas_utilization(r_atlas);
+		print_line(vformat("Packing tier %s: %d ms, %.1f%% utilization, %dx%d in %d atlases.", tiers[tier_i].name, usec / 1000, utilization * 100.0f, r_atlas->width, r_atlas->height, r_atlas->atlasCount));
+		if (utilization > best_utilization) {
+			best_utilization = utilization;
+			best_tier = tier_i;
 		}
+		if (utilization >= p_options.target_utilization) {
+			break;
+		}
+	}
+	if (best_tier >= 0 && best_tier != packed_tier) {
+		r_pack_options.bruteForce = tiers[best_tier].brute_force;
+		xatlas::PackCharts(r_atlas, r_pack_options);
 	}
-	target_image->generate_mipmaps();
-	return target_image;
 }
 
-void MeshTextureAtlas::map_mesh_to_index_to_material(const Vector<MeshState> &p_mesh_items, Array &r_mesh_to_index_to_material, Vector<Ref<Material> > &r_material_cache) {
-	float largest_dimension = 0;
+void MeshTextureAtlas::snapshot_surfaces(const Vector<MeshState> &p_mesh_items, const Vector<uint16_t> &p_surface_material_ids, Vector<SurfaceSnapshot> &r_surfaces) {
+	r_surfaces.resize(p_mesh_items.size());
+	SurfaceSnapshot *surfaces = r_surfaces.ptrw();
 	for (int32_t mesh_i = 0; mesh_i < p_mesh_items.size(); mesh_i++) {
-		Ref<ArrayMesh> array_mesh = p_mesh_items[mesh_i].mesh;
-		for (int32_t j = 0; j < array_mesh->get_surface_count(); j++) {
-			Ref<BaseMaterial3D> mat = array_mesh->surface_get_material(j);
-			if (mat.is_null()) {
-				continue;
+		const MeshState &mesh_state = p_mesh_items[mesh_i];
+		SurfaceSnapshot &surface = surfaces[mesh_i];
+		// The only copy out of the RenderingServer, later stages share these arrays.
+		Array arrays = mesh_state.mesh->surface_get_arrays(mesh_state.surface_index);
+		surface.vertices = arrays[Mesh::ARRAY_VERTEX];
+		surface.normals = arrays[Mesh::ARRAY_NORMAL];
+		surface.uvs = arrays[Mesh::ARRAY_TEX_UV];
+		surface.uv2s = arrays[Mesh::ARRAY_TEX_UV2];
+		surface.indices = arrays[Mesh::ARRAY_INDEX];
+		surface.material_id = mesh_i < p_surface_material_ids.size() ? p_surface_material_ids[mesh_i] : INVALID_MATERIAL_ID;
+		if (mesh_i > 0 && p_mesh_items[mesh_i - 1].mesh_instance == mesh_state.mesh_instance) {
+			surface.transform = surfaces[mesh_i - 1].transform;
+			continue;
+		}
+		surface.transform = _get_merge_transform(mesh_state.mesh_instance);
+	}
+}
+
+Transform3D MeshTextureAtlas::_get_merge_transform(const MeshInstance3D *p_mesh_instance) {
+	// Composed through the parents rather than read globally, so instances outside the tree work too.
+	Transform3D transform = p_mesh_instance->get_transform();
+	Node3D *parent_node = Node3D::cast_to<Node3D>(p_mesh_instance->get_parent());
+	for (; parent_node != nullptr; parent_node = Node3D::cast_to<Node3D>(parent_node->get_parent())) {
+		transform = parent_node->get_transform() * transform;
+	}
+	return transform;
+}
+
+void MeshTextureAtlas::write_uvs(const Vector<SurfaceSnapshot> &p_surfaces, Vector<Vector<Vector2> > &uv_groups, Vector<Vector<ModelVertex> > &r_model_vertices) {
+	r_model_vertices.resize(p_surfaces.size());
+	uv_groups.resize(p_surfaces.size());
+
+	for (int32_t surface_i = 0; surface_i < p_surfaces.size(); surface_i++) {
+		const SurfaceSnapshot &surface = p_surfaces[surface_i];
+		const int32_t vertex_count = surface.vertices.size();
+		// Vertices that no index references keep a zero uv.
+		LocalVector<uint8_t> referenced;
+		referenced.resize(vertex_count);
+		memset(referenced.ptr(), 0, referenced.size());
+		const int32_t *indices = surface.indices.ptr();
+		for (int32_t index_i = 0; index_i < surface.indices.size(); index_i++) {
+			if (static_cast<uint32_t>(indices[index_i]) < referenced.size()) {
+				referenced[indices[index_i]] = 1;
+			}
+		}
+		const bool has_uvs = surface.uvs.size() == vertex_count;
+
+		Vector<ModelVertex> model_vertices;
+		model_vertices.resize(vertex_count);
+		Vector<Vector2> uvs;
+		uvs.resize(vertex_count);
+		ModelVertex *model_vertices_w = model_vertices.ptrw();
+		Vector2 *uvs_w = uvs.ptrw();
+		const Vector3 *vertex_arr = surface.vertices.ptr();
+		const Vector3 *normal_arr = surface.normals.ptr();
+		const Vector2 *uv_arr = surface.uvs.ptr();
+		// Normals follow the inverse transpose, so they stay perpendicular under non-uniform scale.
+		const Basis normal_basis = surface.transform.basis.inverse().transposed();
+		for (int32_t vertex_i = 0; vertex_i < vertex_count; vertex_i++) {
+			ModelVertex vertex_attributes;
+			vertex_attributes.pos = surface.transform.xform(vertex_arr[vertex_i]);
+			ERR_BREAK(surface.normals.size() != vertex_count);
+			vertex_attributes.normal = normal_basis.xform(normal_arr[vertex_i]);
+			vertex_attributes.normal.normalize();
+			if (vertex_attributes.normal.length_squared() < CMP_EPSILON) {
+				vertex_attributes.normal = Vector3(0, 1, 0);
 			}
-			Ref<Texture2D> texture = mat->get_texture(BaseMaterial3D::TEXTURE_ALBEDO);
-			if (texture.is_null()) {
+			model_vertices_w[vertex_i] = vertex_attributes;
+			if (!has_uvs || !referenced[vertex_i]) {
 				continue;
 			}
-			largest_dimension = MAX(texture->get_size().x, texture->get_size().y);
+			// Uvs stay normalised, the rasterizer scales them by the shared source size of the material.
+			uvs_w[vertex_i] = uv_arr[vertex_i];
 		}
+		r_model_vertices.write[surface_i] = model_vertices;
+		uv_groups.write[surface_i] = uvs;
 	}
-	for (int32_t mesh_i = 0; mesh_i < p_mesh_items.size(); mesh_i++) {
-		Ref<ArrayMesh> array_mesh = p_mesh_items[mesh_i].mesh;
-		array_mesh->mesh_unwrap(Transform3D(), TEXEL_SIZE);
-
-		for (int32_t j = 0; j < array_mesh->get_surface_count(); j++) {
-			Array mesh = array_mesh->surface_get_arrays(j);
-			Vector<Vector3> indices = mesh[ArrayMesh::ARRAY_INDEX];
-			Ref<BaseMaterial3D> material = p_mesh_items[mesh_i].mesh->surface_get_material(j);
-			if (material.is_null()) {
-				continue;
+}
+
+void MeshTextureAtlas::_bleed_column_strip_task(void *p_userdata, uint32_t p_strip) {
+	const BleedData *data = static_cast<const BleedData *>(p_userdata);
+	const int32_t begin = p_strip * BleedData::STRIP_WIDTH;
+	const int32_t end = MIN(begin + BleedData::STRIP_WIDTH, data->width);
+	// The strip is swept row by row, so texels and the grid are read sequentially.
+	uint16_t last[BleedData::STRIP_WIDTH];
+	for (int32_t x = begin; x < end; x++) {
+		last[x - begin] = BleedData::NONE;
+	}
+	for (int32_t y = 0; y < data->height; y++) {
+		const uint8_t *row = data->texels + int64_t(y) * data->width * 4;
+		uint16_t *nearest = data->nearest_rows + int64_t(y) * data->width;
+		for (int32_t x = begin; x < end; x++) {
+			if (row[x * 4 + 3] > BLEED_THRESHOLD) {
+				last[x - begin] = y;
 			}
-			if (material->get_texture(BaseMaterial3D::TEXTURE_ALBEDO).is_null()) {
-				Ref<Image> img = Image::create_empty(largest_dimension, largest_dimension, true, Image::FORMAT_RGBA8);
-				img->fill(material->get_albedo());
-				material->set_albedo(Color(1.0f, 1.0f, 1.0f));
-				Ref<ImageTexture> tex = ImageTexture::create_from_image(img);
-				material->set_texture(BaseMaterial3D::TEXTURE_ALBEDO, tex);
+			nearest[x] = last[x - begin];
+		}
+	}
+	for (int32_t x = begin; x < end; x++) {
+		last[x - begin] = BleedData::NONE;
+	}
+	for (int32_t y = data->height - 1; y >= 0; y--) {
+		const uint8_t *row = data->texels + int64_t(y) * data->width * 4;
+		uint16_t *nearest = data->nearest_rows + int64_t(y) * data->width;
+		for (int32_t x = begin; x < end; x++) {
+			if (row[x * 4 + 3] > BLEED_THRESHOLD) {
+				last[x - begin] = y;
 			}
-			if (r_material_cache.find(material) == -1) {
-				r_material_cache.push_back(material);
+			const uint16_t below = last[x - begin];
+			if (below != BleedData::NONE && (nearest[x] == BleedData::NONE || below - y < y - nearest[x])) {
+				nearest[x] = below;
 			}
-			Array materials;
-			materials.resize(indices.size());
-			for (int32_t index_i = 0; index_i < indices.size(); index_i++) {
-				materials[index_i] = material;
+		}
+	}
+}
+
+void MeshTextureAtlas::_bleed_row_task(void *p_userdata, uint32_t p_row) {
+	const BleedData *data = static_cast<const BleedData *>(p_userdata);
+	const int32_t width = data->width;
+	const int32_t y = p_row;
+	const uint16_t *nearest = data->nearest_rows + int64_t(y) * width;
+
+	// Lower envelope of the parabolas (x - q)^2 + dy(q)^2 over the columns q that reach a solid texel.
+	LocalVector<int32_t> sites;
+	LocalVector<double> bounds;
+	sites.resize(width);
+	bounds.resize(width);
+	int32_t count = 0;
+	for (int32_t q = 0; q < width; q++) {
+		if (nearest[q] == BleedData::NONE) {
+			continue;
+		}
+		const int64_t dy_q = nearest[q] - y;
+		const int64_t f_q = dy_q * dy_q + int64_t(q) * q;
+		if (count == 0) {
+			sites[0] = q;
+			bounds[0] = -INFINITY;
+			count = 1;
+			continue;
+		}
+		double boundary = 0.0;
+		while (true) {
+			const int32_t p = sites[count - 1];
+			const int64_t dy_p = nearest[p] - y;
+			boundary = double(f_q - (dy_p * dy_p + int64_t(p) * p)) / (2.0 * (q - p));
+			if (boundary > bounds[count - 1]) {
+				break;
 			}
-			r_mesh_to_index_to_material.push_back(materials);
+			count--;
 		}
+		sites[count] = q;
+		bounds[count] = boundary;
+		count++;
+	}
+	if (count == 0) {
+		return;
+	}
+
+	uint8_t *row = data->texels + int64_t(y) * width * 4;
+	int32_t site_i = 0;
+	for (int32_t x = 0; x < width; x++) {
+		while (site_i + 1 < count && bounds[site_i + 1] < x) {
+			site_i++;
+		}
+		if (row[x * 4 + 3] != 0) {
+			continue;
+		}
+		// Solid texels are never written, so reading them from other rows is safe.
+		const int32_t source_x = sites[site_i];
+		memcpy(row + x * 4, data->texels + (int64_t(nearest[source_x]) * width + source_x) * 4, 3);
 	}
 }
 
-Node *MeshTextureAtlas::_output_mesh_atlas(MergeState &state, int p_count) {
-	if (state.atlas->width == 0 || state.atlas->height == 0) {
-		return nullptr;
+void MeshTextureAtlas::bleed_texels(uint8_t *p_texels, int32_t p_width, int32_t p_height) {
+	ERR_FAIL_NULL(p_texels);
+	ERR_FAIL_COND(p_width <= 0 || p_height <= 0 || p_height >= BleedData::NONE);
+	// Exact euclidean distance transform in two separable passes: columns find their nearest solid row,
+	// then every row picks the closest of those per column. Both passes split across the WorkerThreadPool.
+	LocalVector<uint16_t> nearest_rows;
+	nearest_rows.resize(p_width * p_height);
+	BleedData data;
+	data.texels = p_texels;
+	data.width = p_width;
+	data.height = p_height;
+	data.nearest_rows = nearest_rows.ptr();
+	const uint32_t strips = (p_width + BleedData::STRIP_WIDTH - 1) / BleedData::STRIP_WIDTH;
+	WorkerThreadPool::GroupID group_task = WorkerThreadPool::get_singleton()->add_native_group_task(&_bleed_column_strip_task, &data, strips, -1, true, "SceneMergeBleedColumns");
+	WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_task);
+	group_task = WorkerThreadPool::get_singleton()->add_native_group_task(&_bleed_row_task, &data, p_height, -1, true, "SceneMergeBleedRows");
+	WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_task);
+}
+
+void MeshTextureAtlas::dilate_image(const Ref<Image> &p_image, bool p_opaque) {
+	ERR_FAIL_COND(p_image.is_null() || p_image->is_empty());
+	// Bleeds the image's own texels in place, mipmaps are only built from the bled texels.
+	p_image->clear_mipmaps();
+	if (p_image->get_format() != Image::FORMAT_RGBA8) {
+		p_image->convert(Image::FORMAT_RGBA8);
 	}
-	print_line(vformat("Atlas size: (%d, %d)", state.atlas->width, state.atlas->height));
-	MeshTextureAtlas::TextureData texture_data;
-	for (int32_t mesh_i = 0; mesh_i < state.r_mesh_items.size(); mesh_i++) {
-		if (state.r_mesh_items[mesh_i].mesh_instance->get_parent()) {
+	const int32_t width = p_image->get_width();
+	const int32_t height = p_image->get_height();
+	uint8_t *texels = p_image->ptrw();
+	bleed_texels(texels, width, height);
+	// Bled texels keep a zero alpha, so transparent images keep the gaps between charts.
+	if (p_opaque) {
+		for (int64_t i = 0; i < int64_t(width) * height; i++) {
+			texels[i * 4 + 3] = 255;
+		}
+	}
+	p_image->generate_mipmaps();
+}
+
+void MeshTextureAtlas::map_surfaces_to_material_ids(const Vector<MeshState> &p_mesh_items, const String &p_cache_dir, Vector<uint16_t> &r_surface_material_ids, MaterialRegistry &r_material_cache) {
+	// Several surfaces and instances share a mesh, each mesh is only unwrapped once.
+	// Meshes that already carry lightmap uvs or have a cached unwrap skip it, the rest unwrap concurrently.
+	// The tasks unwrap detached copies, the meshes themselves may be used by the scene and only change on this thread.
+	HashSet<ObjectID> seen_meshes;
+	LocalVector<Ref<ArrayMesh> > unwrap_meshes;
+	LocalVector<Ref<ArrayMesh> > unwrap_copies;
+	LocalVector<String> unwrap_cache_paths;
+	for (const MeshState &mesh_state : p_mesh_items) {
+		Ref<ArrayMesh> array_mesh = mesh_state.mesh;
+		if (array_mesh.is_null() || seen_meshes.has(array_mesh->get_instance_id())) {
+			continue;
+		}
+		seen_meshes.insert(array_mesh->get_instance_id());
+		if (_has_valid_uv2(array_mesh)) {
+			continue;
+		}
+		const String cache_path = _get_unwrap_cache_path(p_cache_dir, array_mesh);
+		if (_load_cached_unwrap(cache_path, array_mesh)) {
+			continue;
+		}
+		unwrap_meshes.push_back(array_mesh);
+		unwrap_copies.push_back(_copy_surface_geometry(array_mesh));
+		unwrap_cache_paths.push_back(cache_path);
+	}
+	if (!unwrap_meshes.is_empty()) {
+		const uint64_t begin = OS::get_singleton()->get_ticks_usec();
+		LocalVector<Error> unwrap_errors;
+		unwrap_errors.resize(unwrap_meshes.size());
+		UnwrapData unwrap_data;
+		unwrap_data.meshes = unwrap_copies.ptr();
+		unwrap_data.errors = unwrap_errors.ptr();
+		WorkerThreadPool::GroupID group_task = WorkerThreadPool::get_singleton()->add_native_group_task(&_unwrap_mesh_task, &unwrap_data, unwrap_meshes.size(), -1, true, "SceneMergeUnwrapMeshes");
+		WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_task);
+		print_line(vformat("Unwrapped %d meshes in %d ms, %d reused their uv2 or a cached unwrap.", unwrap_meshes.size(), (OS::get_singleton()->get_ticks_usec() - begin) / 1000, seen_meshes.size() - unwrap_meshes.size()));
+		// A failed unwrap leaves the mesh as it was and is not cached, so the next merge tries it again.
+		for (uint32_t mesh_i = 0; mesh_i < unwrap_meshes.size(); mesh_i++) {
+			if (unwrap_errors[mesh_i] == OK) {
+				_replace_surface_geometry(unwrap_meshes[mesh_i], unwrap_copies[mesh_i]);
+				_save_cached_unwrap(unwrap_cache_paths[mesh_i], unwrap_copies[mesh_i]);
+			}
+		}
+	}
+
+	for (const MeshState &mesh_state : p_mesh_items) {
+		// Every surface gets an id, so the ids stay aligned with p_mesh_items even for surfaces that are not merged.
+		Ref<BaseMaterial3D> material = mesh_state.mesh->surface_get_material(mesh_state.surface_index);
+		if (material.is_null()) {
+			r_surface_material_ids.push_back(INVALID_MATERIAL_ID);
+			continue;
+		}
+		const uint16_t material_id = r_material_cache.add(material);
+		if (material_id == INVALID_MATERIAL_ID) {
+			r_surface_material_ids.push_back(INVALID_MATERIAL_ID);
+			ERR_CONTINUE_MSG(true, "Too many materials to merge.");
+		}
+		r_surface_material_ids.push_back(material_id);
+	}
+}
+
+void MeshTextureAtlas::_replace_mesh_instances(const Vector<MeshState> &p_mesh_items) {
+	for (int32_t mesh_i = 0; mesh_i < p_mesh_items.size(); mesh_i++) {
+		if (p_mesh_items[mesh_i].mesh_instance->get_parent()) {
 			Node3D *node_3d = memnew(Node3D);
-			Transform3D transform = state.r_mesh_items[mesh_i].mesh_instance->get_transform();
+			Transform3D transform = p_mesh_items[mesh_i].mesh_instance->get_transform();
 			node_3d->set_transform(transform);
-			node_3d->set_name(state.r_mesh_items[mesh_i].mesh_instance->get_name());
-			state.r_mesh_items[mesh_i].mesh_instance->replace_by(node_3d);
+			node_3d->set_name(p_mesh_items[mesh_i].mesh_instance->get_name());
+			p_mesh_items[mesh_i].mesh_instance->replace_by(node_3d);
+		}
+	}
+}
+
+MeshInstance3D *MeshTextureAtlas::_create_output_instance(const Ref<ArrayMesh> &p_mesh, const String &p_name) {
+	MeshInstance3D *mesh_instance = memnew(MeshInstance3D);
+	mesh_instance->set_mesh(p_mesh);
+	mesh_instance->set_name(p_name);
+	Transform3D root_transform;
+	mesh_instance->set_transform(root_transform.affine_inverse());
+	return mesh_instance;
+}
+
+void MeshTextureAtlas::_output_part_task(void *p_userdata, uint32_t p_index) {
+	OutputMeshData *data = static_cast<OutputMeshData *>(p_userdata);
+	const MergeState &state = *data->state;
+	const int32_t surface_i = data->part_surfaces[p_index];
+	const SurfaceSnapshot &surface = state.surfaces[surface_i];
+	const Vector<ModelVertex> &model_vertices = state.model_vertices[surface_i];
+	const int32_t vertex_offset = data->vertex_offsets[p_index];
+	const int32_t index_offset = data->index_offsets[p_index];
+	if (p_index < state.atlas->meshCount) {
+		const xatlas::Mesh &mesh = state.atlas->meshes[p_index];
+		const Vector2 atlas_size(state.atlas->width, state.atlas->height);
+		for (uint32_t v = 0; v < mesh.vertexCount; v++) {
+			const xatlas::Vertex &vertex = mesh.vertexArray[v];
+			ERR_CONTINUE_MSG(vertex.xref >= static_cast<uint32_t>(model_vertices.size()), "Vertex reference not found. " + vformat("Vertex %d: xref=%d", v, vertex.xref));
+			const ModelVertex &source_vertex = model_vertices[vertex.xref];
+			data->positions[vertex_offset + v] = source_vertex.pos;
+			data->normals[vertex_offset + v] = source_vertex.normal;
+			data->uvs[vertex_offset + v] = Vector2(vertex.uv[0], vertex.uv[1]) / atlas_size;
+			data->local_vertices[vertex_offset + v] = surface.vertices[vertex.xref];
+			data->vertex_surfaces[vertex_offset + v] = surface_i;
 		}
+		for (uint32_t i = 0; i < mesh.indexCount; i++) {
+			data->indices[index_offset + i] = vertex_offset + mesh.indexArray[i];
+		}
+		return;
+	}
+	// Flat colour surfaces keep their own indices, every vertex samples the centre of the material's palette cell.
+	const Rect2i &cell = state.palette_cells[surface.material_id];
+	const Vector2 uv = (Vector2(cell.position) + Vector2(cell.size) * 0.5f) / Vector2(state.atlas->width, state.atlas->height);
+	for (int32_t vertex_i = 0; vertex_i < model_vertices.size(); vertex_i++) {
+		data->positions[vertex_offset + vertex_i] = model_vertices[vertex_i].pos;
+		data->normals[vertex_offset + vertex_i] = model_vertices[vertex_i].normal;
+		data->uvs[vertex_offset + vertex_i] = uv;
+		data->local_vertices[vertex_offset + vertex_i] = surface.vertices[vertex_i];
+		data->vertex_surfaces[vertex_offset + vertex_i] = surface_i;
+	}
+	for (int32_t i = 0; i < surface.indices.size(); i++) {
+		data->indices[index_offset + i] = vertex_offset + surface.indices[i];
 	}
-	Ref<SurfaceTool> surface_tool_all;
-	surface_tool_all.instantiate();
-	surface_tool_all->begin(Mesh::PRIMITIVE_TRIANGLES);
+}
+
+MeshInstance3D *MeshTextureAtlas::_output_mesh_atlas(MergeState &state, int p_count) {
+	if (state.atlas->width == 0 || state.atlas->height == 0) {
+		return nullptr;
+	}
+	print_line(vformat("Atlas size: (%d, %d)", state.atlas->width, state.atlas->height));
+	// Every xatlas mesh and flat colour surface is one output part, written straight into its slice of the output arrays.
+	LocalVector<int32_t> part_surfaces;
+	LocalVector<int32_t> vertex_offsets;
+	LocalVector<int32_t> index_offsets;
+	int32_t vertex_count = 0;
+	int32_t index_count = 0;
 	for (uint32_t mesh_i = 0; mesh_i < state.atlas->meshCount; mesh_i++) {
-		Ref<SurfaceTool> surface_tool;
-		surface_tool.instantiate();
-		surface_tool->begin(Mesh::PRIMITIVE_TRIANGLES);
 		const xatlas::Mesh &mesh = state.atlas->meshes[mesh_i];
-		print_line(vformat("Mesh %d: vertexCount=%d, indexCount=%d", mesh_i, mesh.vertexCount, mesh.indexCount));
-		uint32_t max_vertices = 32 * 1024;
-		uint32_t num_parts = (mesh.vertexCount / max_vertices) + 1;
-		print_line(vformat("Number of parts for Mesh %d: %d", mesh_i, num_parts));
-		for (uint32_t part = 0; part < num_parts; part++) {
-			uint32_t start = part * max_vertices;
-			uint32_t end = MIN((part + 1) * max_vertices, mesh.vertexCount);
-			print_line(vformat("Part %d: Start=%d, End=%d", part, start, end));
-
-			for (uint32_t v = start; v < end; v++) {
-				const xatlas::Vertex vertex = mesh.vertexArray[v];
-				ERR_BREAK_MSG(vertex.xref < 0 || vertex.xref >= static_cast<uint32_t>(state.model_vertices[mesh_i].size()),
-						"Vertex reference not found. " + vformat("Vertex %d: xref=%d", v, vertex.xref));
-				const ModelVertex &sourceVertex = state.model_vertices[mesh_i][vertex.xref - start];
-				Vector2 uv = Vector2(vertex.uv[0] / state.atlas->width, vertex.uv[1] / state.atlas->height);
-				surface_tool->set_uv(uv);
-				surface_tool->set_normal(sourceVertex.normal);
-				surface_tool->set_color(Color(1.0f, 1.0f, 1.0f));
-				surface_tool->add_vertex(sourceVertex.pos);
-			}
-			for (uint32_t i = 0; i < mesh.indexCount; i++) {
-				uint32_t index = mesh.indexArray[i];
-				surface_tool->add_index(index);
-			}
-			surface_tool->generate_tangents();
-			Ref<ArrayMesh> array_mesh = surface_tool->commit();
-			surface_tool_all->append_from(array_mesh, 0, Transform3D());
+		part_surfaces.push_back(state.atlas_surfaces[mesh_i]);
+		vertex_offsets.push_back(vertex_count);
+		index_offsets.push_back(index_count);
+		vertex_count += mesh.vertexCount;
+		index_count += mesh.indexCount;
+	}
+	for (int32_t surface_i = 0; surface_i < state.surfaces.size(); surface_i++) {
+		const SurfaceSnapshot &surface = state.surfaces[surface_i];
+		if (surface.material_id >= state.palette_cells.size() || !state.palette_cells[surface.material_id].has_area()) {
+			continue;
 		}
+		part_surfaces.push_back(surface_i);
+		vertex_offsets.push_back(vertex_count);
+		index_offsets.push_back(index_count);
+		vertex_count += surface.vertices.size();
+		index_count += surface.indices.size();
 	}
+	print_line(vformat("Output mesh: %d parts, vertexCount=%d, indexCount=%d", part_surfaces.size(), vertex_count, index_count));
+
+	PackedVector3Array positions;
+	PackedVector3Array normals;
+	PackedVector2Array uvs;
+	PackedInt32Array indices;
+	positions.resize(vertex_count);
+	normals.resize(vertex_count);
+	uvs.resize(vertex_count);
+	indices.resize(index_count);
+	state.output_local_vertices.resize(vertex_count);
+	state.output_vertex_surfaces.resize(vertex_count);
+	OutputMeshData output_data;
+	output_data.state = &state;
+	output_data.part_surfaces = part_surfaces.ptr();
+	output_data.vertex_offsets = vertex_offsets.ptr();
+	output_data.index_offsets = index_offsets.ptr();
+	output_data.positions = positions.ptrw();
+	output_data.normals = normals.ptrw();
+	output_data.uvs = uvs.ptrw();
+	output_data.indices = indices.ptrw();
+	output_data.local_vertices = state.output_local_vertices.ptrw();
+	output_data.vertex_surfaces = state.output_vertex_surfaces.ptrw();
+	WorkerThreadPool::GroupID group_task = WorkerThreadPool::get_singleton()->add_native_group_task(&_output_part_task, &output_data, part_surfaces.size(), -1, true, "SceneMergeOutputMesh");
+	WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group_task);
+
+	PackedColorArray colors;
+	colors.resize(vertex_count);
+	colors.fill(Color(1.0f, 1.0f, 1.0f));
+	Array arrays;
+	arrays.resize(Mesh::ARRAY_MAX);
+	arrays[Mesh::ARRAY_VERTEX] = positions;
+	arrays[Mesh::ARRAY_NORMAL] = normals;
+	arrays[Mesh::ARRAY_COLOR] = colors;
+	arrays[Mesh::ARRAY_TEX_UV] = uvs;
+	arrays[Mesh::ARRAY_INDEX] = indices;
+	// Tangents are generated once, on the final surface.
+	Ref<SurfaceTool> surface_tool;
+	surface_tool.instantiate();
+	surface_tool->create_from_triangle_arrays(arrays);
+	surface_tool->generate_tangents();
+	Ref<ArrayMesh> array_mesh;
+	array_mesh.instantiate();
+	array_mesh->add_surface_from_arrays(Mesh::PRIMITIVE_TRIANGLES, surface_tool->commit_to_arrays());
 	Ref<StandardMaterial3D> material;
 	material.instantiate();
 	HashMap<String, Ref<Image> >::Iterator A = state.texture_atlas.find("albedo");
 	if (A && !A->key.is_empty()) {
-		Ref<Image> img = dilate_image(A->value);
-		print_line(vformat("Albedo image size: (%d, %d)", img->get_width(), img->get_height()));
-		Ref<ImageTexture> tex = ImageTexture::create_from_image(img);
+		dilate_image(A->value, _is_opaque_atlas_channel(state, "albedo"));
+		print_line(vformat("Albedo image size: (%d, %d)", A->value->get_width(), A->value->get_height()));
+		Ref<ImageTexture> tex = ImageTexture::create_from_image(A->value);
 		material->set_texture(BaseMaterial3D::TEXTURE_ALBEDO, tex);
 	}
-	material->set_cull_mode(BaseMaterial3D::CULL_DISABLED);
-	MeshInstance3D *mesh_instance = memnew(MeshInstance3D);
-	Ref<ArrayMesh> array_mesh = surface_tool_all->commit();
-	mesh_instance->set_mesh(array_mesh);
-	mesh_instance->set_name(state.p_name);
-	Transform3D root_transform;
-	mesh_instance->set_transform(root_transform.affine_inverse());
+	HashMap<String, Ref<Image> >::Iterator N = state.texture_atlas.find("normal");
+	if (N) {
+		dilate_image(N->value);
+		Ref<ImageTexture> tex = ImageTexture::create_from_image(N->value);
+		material->set_feature(BaseMaterial3D::FEATURE_NORMAL_MAPPING, true);
+		material->set_texture(BaseMaterial3D::TEXTURE_NORMAL, tex);
+	}
+	HashMap<String, Ref<Image> >::Iterator O = state.texture_atlas.find("orm");
+	if (O) {
+		// Roughness and metallic factors are baked into the ORM atlas.
+		dilate_image(O->value);
+		Ref<ImageTexture> tex = ImageTexture::create_from_image(O->value);
+		material->set_feature(BaseMaterial3D::FEATURE_AMBIENT_OCCLUSION, true);
+		material->set_texture(BaseMaterial3D::TEXTURE_AMBIENT_OCCLUSION, tex);
+		material->set_ao_texture_channel(BaseMaterial3D::TEXTURE_CHANNEL_RED);
+		material->set_texture(BaseMaterial3D::TEXTURE_ROUGHNESS, tex);
+		material->set_roughness_texture_channel(BaseMaterial3D::TEXTURE_CHANNEL_GREEN);
+		material->set_roughness(1.0);
+		material->set_texture(BaseMaterial3D::TEXTURE_METALLIC, tex);
+		material->set_metallic_texture_channel(BaseMaterial3D::TEXTURE_CHANNEL_BLUE);
+		material->set_metallic(1.0);
+	}
+	HashMap<String, Ref<Image> >::Iterator E = state.texture_atlas.find("emission");
+	if (E) {
+		dilate_image(E->value);
+		Ref<ImageTexture> tex = ImageTexture::create_from_image(E->value);
+		material->set_feature(BaseMaterial3D::FEATURE_EMISSION, true);
+		material->set_emission(Color(1.0, 1.0, 1.0));
+		material->set_emission_operator(BaseMaterial3D::EMISSION_OP_MULTIPLY);
+		material->set_texture(BaseMaterial3D::TEXTURE_EMISSION, tex);
+	}
+	// Every material of a merge group shares its render features, see partition_mesh_items_by_material.
+	const Ref<BaseMaterial3D> source_material = state.material_cache.get(0);
+	if (source_material.is_valid()) {
+		_copy_material_features(source_material, material);
+	}
 	array_mesh->surface_set_material(0, material);
+	MeshInstance3D *mesh_instance = _create_output_instance(array_mesh, state.p_name);
+	if (!state.texture_atlas_tiles.is_empty()) {
+		// Streamed channels are too large for one texture, the tiles on disk are listed for the importer instead.
+		Dictionary tiles;
+		for (const KeyValue<String, PackedStringArray> &E : state.texture_atlas_tiles) {
+			tiles[E.key] = E.value;
+		}
+		mesh_instance->set_meta("scene_merge_atlas_tiles", tiles);
+		mesh_instance->set_meta("scene_merge_atlas_tile_size", STREAM_TILE_SIZE);
+	}
 	return mesh_instance;
 }
 
+static void _hash_variant(const Ref<HashingContext> &p_context, const Variant &p_value) {
+	int length = 0;
+	ERR_FAIL_COND(encode_variant(p_value, nullptr, length) != OK);
+	PackedByteArray buffer;
+	buffer.resize(length);
+	encode_variant(p_value, buffer.ptrw(), length);
+	p_context->update(buffer);
+}
+
+// Hashes the content of a mesh or texture, its digest is computed once however many surfaces of the merge use it.
+static void _hash_content(const Ref<HashingContext> &p_context, const Ref<Resource> &p_resource, HashMap<ObjectID, PackedByteArray> &r_digests) {
+	if (p_resource.is_null()) {
+		_hash_variant(p_context, Variant());
+		return;
+	}
+	HashMap<ObjectID, PackedByteArray>::ConstIterator E = r_digests.find(p_resource->get_instance_id());
+	if (E) {
+		p_context->update(E->value);
+		return;
+	}
+	Ref<HashingContext> context;
+	context.instantiate();
+	context->start(HashingContext::HASH_SHA256);
+	_hash_variant(context, p_resource->get_class());
+	const Ref<Mesh> mesh = p_resource;
+	const Ref<Texture2D> texture = p_resource;
+	if (mesh.is_valid()) {
+		for (int32_t surface_i = 0; surface_i < mesh->get_surface_count(); surface_i++) {
+			_hash_variant(context, mesh->surface_get_arrays(surface_i));
+		}
+	} else if (texture.is_valid()) {
+		const Ref<Image> image = texture->get_image();
+		if (image.is_valid() && !image->is_empty()) {
+			_hash_variant(context, Vector3i(image->get_width(), image->get_height(), image->get_format()));
+			context->update(image->get_data());
+		}
+	}
+	const PackedByteArray digest = context->finish();
+	r_digests.insert(p_resource->get_instance_id(), digest);
+	p_context->update(digest);
+}
+
+// Hashes every setting that changes the merge output, shared by the merge and layout cache keys.
+static void _hash_merge_settings(const Ref<HashingContext> &p_context, const xatlas::PackOptions &p_pack_options, const MeshTextureAtlas::MergeOptions &p_options) {
+	Array settings;
+	settings.push_back(MeshTextureAtlas::MERGE_CACHE_VERSION);
+	settings.push_back(MeshTextureAtlas::TEXEL_SIZE);
+	settings.push_back(p_pack_options.bilinear);
+	settings.push_back(p_pack_options.padding);
+	settings.push_back(p_options.target_utilization);
+	settings.push_back(p_options.brute_force_packing);
+	settings.push_back(p_pack_options.blockAlign);
+	settings.push_back(p_pack_options.rotateCharts);
+	settings.push_back(p_pack_options.rotateChartsToAxis);
+	settings.push_back(p_pack_options.resolution);
+	settings.push_back(p_pack_options.texelsPerUnit);
+	_hash_variant(p_context, settings);
+}
+
+String MeshTextureAtlas::_get_merge_cache_path(const Vector<MeshState> &p_mesh_items, const xatlas::PackOptions &p_pack_options, const MergeOptions &p_options) {
+	Ref<HashingContext> context;
+	context.instantiate();
+	ERR_FAIL_COND_V(context->start(HashingContext::HASH_SHA256) != OK, String());
+	_hash_merge_settings(context, p_pack_options, p_options);
+
+	HashMap<ObjectID, PackedByteArray> digests;
+	for (const MeshState &mesh_state : p_mesh_items) {
+		_hash_content(context, mesh_state.mesh, digests);
+		_hash_variant(context, mesh_state.surface_index);
+		// Materials are hashed by their stored properties, textures by their image content.
+		const Ref<Material> material = mesh_state.mesh->surface_get_material(mesh_state.surface_index);
+		if (material.is_null()) {
+			continue;
+		}
+		List<PropertyInfo> properties;
+		material->get_property_list(&properties);
+		for (const PropertyInfo &property : properties) {
+			if (!(property.usage & PROPERTY_USAGE_STORAGE)) {
+				continue;
+			}
+			const Variant value = material->get(property.name);
+			_hash_variant(context, property.name);
+			if (value.get_type() == Variant::OBJECT) {
+				_hash_content(context, value, digests);
+			} else {
+				_hash_variant(context, value);
+			}
+		}
+	}
+	const PackedByteArray digest = context->finish();
+	const String hash = String::hex_encode_buffer(digest.ptr(), digest.size());
+	return _get_cache_dir(p_options).path_join(hash + ".res");
+}
+
+String MeshTextureAtlas::_get_cache_dir(const MergeOptions &p_options) {
+	if (!p_options.cache_path.is_empty()) {
+		return p_options.cache_path;
+	}
+	return ProjectSettings::get_singleton()->get_project_data_path().path_join("scene_merge");
+}
+
+void MeshTextureAtlas::_unwrap_mesh_task(void *p_userdata, uint32_t p_index) {
+	// Every task owns a different detached copy, the unwrap itself keeps no shared state.
+	UnwrapData *data = static_cast<UnwrapData *>(p_userdata);
+	Ref<ArrayMesh> &mesh = data->meshes[p_index];
+	data->errors[p_index] = mesh->mesh_unwrap(Transform3D(), TEXEL_SIZE);
+	ERR_FAIL_COND_MSG(data->errors[p_index] != OK, "Cannot unwrap mesh: " + mesh->get_name());
+}
+
+bool MeshTextureAtlas::_has_valid_uv2(const Ref<ArrayMesh> &p_mesh) {
+	if (p_mesh->get_surface_count() == 0) {
+		return false;
+	}
+	for (int32_t surface_i = 0; surface_i < p_mesh->get_surface_count(); surface_i++) {
+		if (!(p_mesh->surface_get_format(surface_i) & Mesh::ARRAY_FORMAT_TEX_UV2)) {
+			return false;
+		}
+	}
+	// Lightmap uvs stay inside the unit square and span some area.
+	for (int32_t surface_i = 0; surface_i < p_mesh->get_surface_count(); surface_i++) {
+		const PackedVector2Array uv2s = p_mesh->surface_get_arrays(surface_i)[Mesh::ARRAY_TEX_UV2];
+		if (uv2s.is_empty()) {
+			return false;
+		}
+		Rect2 bounds(uv2s[0], Size2());
+		for (const Vector2 &uv2 : uv2s) {
+			bounds.expand_to(uv2);
+		}
+		if (!Rect2(-CMP_EPSILON, -CMP_EPSILON, 1.0 + CMP_EPSILON * 2.0, 1.0 + CMP_EPSILON * 2.0).encloses(bounds) || !bounds.has_area()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+String MeshTextureAtlas::_get_unwrap_cache_path(const String &p_cache_dir, const Ref<ArrayMesh> &p_mesh) {
+	Ref<HashingContext> context;
+	context.instantiate();
+	ERR_FAIL_COND_V(context->start(HashingContext::HASH_SHA256) != OK, String());
+	Array settings;
+	settings.push_back(MERGE_CACHE_VERSION);
+	settings.push_back(TEXEL_SIZE);
+	_hash_variant(context, settings);
+	HashMap<ObjectID, PackedByteArray> digests;
+	_hash_content(context, p_mesh, digests);
+	const PackedByteArray digest = context->finish();
+	return p_cache_dir.path_join("unwrap").path_join(String::hex_encode_buffer(digest.ptr(), digest.size()) + ".res");
+}
+
+bool MeshTextureAtlas::_load_cached_unwrap(const String &p_cache_path, const Ref<ArrayMesh> &p_mesh) {
+	if (p_cache_path.is_empty() || !FileAccess::exists(p_cache_path)) {
+		return false;
+	}
+	const Ref<ArrayMesh> cached = ResourceLoader::load(p_cache_path, "ArrayMesh", ResourceFormatLoader::CACHE_MODE_IGNORE);
+	if (cached.is_null() || cached->get_surface_count() != p_mesh->get_surface_count()) {
+		return false;
+	}
+	for (int32_t surface_i = 0; surface_i < cached->get_surface_count(); surface_i++) {
+		if (!(cached->surface_get_format(surface_i) & Mesh::ARRAY_FORMAT_TEX_UV2)) {
+			WARN_PRINT("Ignoring an unwrap cache entry without uv2: " + p_cache_path);
+			return false;
+		}
+	}
+	_replace_surface_geometry(p_mesh, cached);
+	return true;
+}
+
+Ref<ArrayMesh> MeshTextureAtlas::_copy_surface_geometry(const Ref<ArrayMesh> &p_mesh) {
+	Ref<ArrayMesh> geometry;
+	geometry.instantiate();
+	for (int32_t surface_i = 0; surface_i < p_mesh->get_surface_count(); surface_i++) {
+		geometry->add_surface_from_arrays(p_mesh->surface_get_primitive_type(surface_i), p_mesh->surface_get_arrays(surface_i));
+	}
+	return geometry;
+}
+
+void MeshTextureAtlas::_replace_surface_geometry(const Ref<ArrayMesh> &p_mesh, const Ref<ArrayMesh> &p_geometry) {
+	ERR_FAIL_COND(p_geometry->get_surface_count() != p_mesh->get_surface_count());
+	// Only the geometry is replaced, materials and names stay those of the mesh.
+	LocalVector<Ref<Material> > materials;
+	LocalVector<String> names;
+	for (int32_t surface_i = 0; surface_i < p_mesh->get_surface_count(); surface_i++) {
+		materials.push_back(p_mesh->surface_get_material(surface_i));
+		names.push_back(p_mesh->surface_get_name(surface_i));
+	}
+	p_mesh->clear_surfaces();
+	for (int32_t surface_i = 0; surface_i < p_geometry->get_surface_count(); surface_i++) {
+		p_mesh->add_surface_from_arrays(p_geometry->surface_get_primitive_type(surface_i), p_geometry->surface_get_arrays(surface_i));
+		p_mesh->surface_set_material(surface_i, materials[surface_i]);
+		p_mesh->surface_set_name(surface_i, names[surface_i]);
+	}
+}
+
+void MeshTextureAtlas::_save_cached_unwrap(const String &p_cache_path, const Ref<ArrayMesh> &p_geometry) {
+	if (p_cache_path.is_empty()) {
+		return;
+	}
+	Error err = DirAccess::make_dir_recursive_absolute(p_cache_path.get_base_dir());
+	ERR_FAIL_COND_MSG(err != OK && err != ERR_ALREADY_EXISTS, "Cannot create the unwrap cache directory: " + p_cache_path.get_base_dir());
+	err = ResourceSaver::save(p_geometry, p_cache_path, ResourceSaver::FLAG_COMPRESS);
+	ERR_FAIL_COND_MSG(err != OK, "Cannot save the unwrap cache: " + p_cache_path);
+}
+
+Ref<ArrayMesh> MeshTextureAtlas::_load_cached_merge(const String &p_cache_path, const Vector<MeshState> &p_mesh_items) {
+	if (p_cache_path.is_empty() || !FileAccess::exists(p_cache_path)) {
+		return Ref<ArrayMesh>();
+	}
+	Ref<ArrayMesh> mesh = ResourceLoader::load(p_cache_path, "ArrayMesh", ResourceFormatLoader::CACHE_MODE_IGNORE);
+	if (mesh.is_null() || mesh->get_surface_count() != 1) {
+		return Ref<ArrayMesh>();
+	}
+	const PackedVector3Array local_vertices = mesh->get_meta("scene_merge_local_vertices", PackedVector3Array());
+	const PackedInt32Array vertex_surfaces = mesh->get_meta("scene_merge_vertex_surfaces", PackedInt32Array());
+	const Array cached_transforms = mesh->get_meta("scene_merge_transforms", Array());
+	if (cached_transforms.size() != p_mesh_items.size() || local_vertices.size() != vertex_surfaces.size() || local_vertices.size() != mesh->surface_get_array_len(0)) {
+		return Ref<ArrayMesh>();
+	}
+	mesh->remove_meta("scene_merge_local_vertices");
+	mesh->remove_meta("scene_merge_vertex_surfaces");
+	mesh->remove_meta("scene_merge_transforms");
+	// The merged mesh is embedded in the scene, not referenced from the cache.
+	mesh->set_path("");
+
+	// The layout and atlas only depend on meshes and materials, moved instances just need their vertices re-transformed.
+	LocalVector<Transform3D> transforms;
+	LocalVector<bool> moved;
+	transforms.resize(p_mesh_items.size());
+	moved.resize(p_mesh_items.size());
+	bool any_moved = false;
+	for (int32_t mesh_i = 0; mesh_i < p_mesh_items.size(); mesh_i++) {
+		transforms[mesh_i] = _get_merge_transform(p_mesh_items[mesh_i].mesh_instance);
+		moved[mesh_i] = !transforms[mesh_i].is_equal_approx(cached_transforms[mesh_i]);
+		any_moved = any_moved || moved[mesh_i];
+	}
+	if (!any_moved) {
+		return mesh;
+	}
+	// Normals and tangents are moved from the cached transform to the new one, the local ones are not kept.
+	LocalVector<Basis> normal_bases;
+	LocalVector<Basis> tangent_bases;
+	normal_bases.resize(p_mesh_items.size());
+	tangent_bases.resize(p_mesh_items.size());
+	for (int32_t mesh_i = 0; mesh_i < p_mesh_items.size(); mesh_i++) {
+		if (moved[mesh_i]) {
+			const Transform3D cached_transform = cached_transforms[mesh_i];
+			const Basis cached_basis = cached_transform.basis;
+			normal_bases[mesh_i] = transforms[mesh_i].basis.inverse().transposed() * cached_basis.transposed();
+			tangent_bases[mesh_i] = transforms[mesh_i].basis * cached_basis.inverse();
+		}
+	}
+	Array arrays = mesh->surface_get_arrays(0);
+	PackedVector3Array vertices = arrays[Mesh::ARRAY_VERTEX];
+	PackedVector3Array normals = arrays[Mesh::ARRAY_NORMAL];
+	PackedFloat32Array tangents = arrays[Mesh::ARRAY_TANGENT];
+	const bool has_normals = normals.size() == vertices.size();
+	const bool has_tangents = tangents.size() == vertices.size() * 4;
+	Vector3 *vertices_w = vertices.ptrw();
+	Vector3 *normals_w = normals.ptrw();
+	float *tangents_w = tangents.ptrw();
+	const int32_t *vertex_surfaces_r = vertex_surfaces.ptr();
+	for (int32_t vertex_i = 0; vertex_i < vertices.size(); vertex_i++) {
+		const int32_t surface_i = vertex_surfaces_r[vertex_i];
+		ERR_FAIL_INDEX_V(surface_i, int32_t(moved.size()), Ref<ArrayMesh>());
+		if (!moved[surface_i]) {
+			continue;
+		}
+		vertices_w[vertex_i] = transforms[surface_i].xform(local_vertices[vertex_i]);
+		if (has_normals) {
+			normals_w[vertex_i] = normal_bases[surface_i].xform(normals_w[vertex_i]).normalized();
+		}
+		if (has_tangents) {
+			float *tangent = tangents_w + vertex_i * 4;
+			const Vector3 moved_tangent = tangent_bases[surface_i].xform(Vector3(tangent[0], tangent[1], tangent[2])).normalized();
+			tangent[0] = moved_tangent.x;
+			tangent[1] = moved_tangent.y;
+			tangent[2] = moved_tangent.z;
+		}
+	}
+	arrays[Mesh::ARRAY_VERTEX] = vertices;
+	arrays[Mesh::ARRAY_NORMAL] = normals;
+	arrays[Mesh::ARRAY_TANGENT] = tangents;
+	const Ref<Material> material = mesh->surface_get_material(0);
+	mesh->clear_surfaces();
+	mesh->add_surface_from_arrays(Mesh::PRIMITIVE_TRIANGLES, arrays);
+	mesh->surface_set_material(0, material);
+
+	Array new_transforms;
+	for (const Transform3D &transform : transforms) {
+		new_transforms.push_back(transform);
+	}
+	_save_cached_merge(p_cache_path, mesh, local_vertices, vertex_surfaces, new_transforms);
+	print_line(vformat("Re-transformed cached merge: %d vertices.", vertices.size()));
+	return mesh;
+}
+
+void MeshTextureAtlas::_save_cached_merge(const String &p_cache_path, const Ref<ArrayMesh> &p_mesh, const PackedVector3Array &p_local_vertices, const PackedInt32Array &p_vertex_surfaces, const Array &p_transforms) {
+	ERR_FAIL_COND(p_mesh.is_null());
+	Error err = DirAccess::make_dir_recursive_absolute(p_cache_path.get_base_dir());
+	ERR_FAIL_COND_MSG(err != OK && err != ERR_ALREADY_EXISTS, "Cannot create the merge cache directory: " + p_cache_path.get_base_dir());
+	// The re-transform data only lives in the cache, it is removed again so the scene does not carry it.
+	p_mesh->set_meta("scene_merge_local_vertices", p_local_vertices);
+	p_mesh->set_meta("scene_merge_vertex_surfaces", p_vertex_surfaces);
+	p_mesh->set_meta("scene_merge_transforms", p_transforms);
+	err = ResourceSaver::save(p_mesh, p_cache_path, ResourceSaver::FLAG_COMPRESS);
+	p_mesh->remove_meta("scene_merge_local_vertices");
+	p_mesh->remove_meta("scene_merge_vertex_surfaces");
+	p_mesh->remove_meta("scene_merge_transforms");
+	ERR_FAIL_COND_MSG(err != OK, "Cannot save the merge cache: " + p_cache_path);
+}
+
+String MeshTextureAtlas::_get_layout_cache_path(const Vector<SurfaceSnapshot> &p_surfaces, const LocalVector<bool> &p_flat_materials, const xatlas::PackOptions &p_pack_options, const MergeOptions &p_options) {
+	Ref<HashingContext> context;
+	context.instantiate();
+	ERR_FAIL_COND_V(context->start(HashingContext::HASH_SHA256) != OK, String());
+	_hash_merge_settings(context, p_pack_options, p_options);
+	// Only the xatlas inputs are hashed, so positions, normals, source uvs and material properties may change without a repack.
+	for (const SurfaceSnapshot &surface : p_surfaces) {
+		const bool flat = surface.material_id < p_flat_materials.size() && p_flat_materials[surface.material_id];
+		_hash_variant(context, Vector2i(surface.material_id, flat));
+		if (flat) {
+			continue;
+		}
+		_hash_variant(context, surface.uv2s);
+		_hash_variant(context, surface.indices);
+	}
+	const PackedByteArray digest = context->finish();
+	return _get_cache_dir(p_options).path_join("layout").path_join(String::hex_encode_buffer(digest.ptr(), digest.size()) + ".bin");
+}
+
+bool MeshTextureAtlas::_load_cached_layout(const String &p_cache_path, const Vector<SurfaceSnapshot> &p_surfaces, CachedAtlasLayout &r_layout, LocalVector<int32_t> &r_atlas_surfaces) {
+	if (p_cache_path.is_empty() || !FileAccess::exists(p_cache_path)) {
+		return false;
+	}
+	Ref<FileAccess> file = FileAccess::open(p_cache_path, FileAccess::READ);
+	if (file.is_null()) {
+		return false;
+	}
+	const Dictionary layout = file->get_var();
+	const PackedInt32Array atlas_surfaces = layout.get("surfaces", PackedInt32Array());
+	const Array meshes = layout.get("meshes", Array());
+	if (meshes.size() != atlas_surfaces.size()) {
+		return false;
+	}
+	// Every array is filled before any pointer into it is taken.
+	r_layout.meshes.resize(meshes.size());
+	r_layout.vertices.resize(meshes.size());
+	r_layout.indices.resize(meshes.size());
+	r_layout.charts.resize(meshes.size());
+	r_layout.chart_faces.resize(meshes.size());
+	uint32_t chart_count = 0;
+	for (int32_t mesh_i = 0; mesh_i < meshes.size(); mesh_i++) {
+		const int32_t surface_i = atlas_surfaces[mesh_i];
+		if (surface_i < 0 || surface_i >= p_surfaces.size()) {
+			return false;
+		}
+		const Dictionary mesh_data = meshes[mesh_i];
+		const PackedFloat32Array uvs = mesh_data.get("uvs", PackedFloat32Array());
+		const PackedInt32Array xrefs = mesh_data.get("xrefs", PackedInt32Array());
+		const PackedInt32Array indices = mesh_data.get("indices", PackedInt32Array());
+		const PackedInt32Array chart_materials = mesh_data.get("chart_materials", PackedInt32Array());
+		const Array chart_faces = mesh_data.get("chart_faces", Array());
+		if (uvs.size() != xrefs.size() * 2 || indices.size() % 3 != 0 || chart_faces.size() != chart_materials.size()) {
+			return false;
+		}
+		LocalVector<xatlas::Vertex> &vertices = r_layout.vertices[mesh_i];
+		vertices.resize(xrefs.size());
+		for (int32_t vertex_i = 0; vertex_i < xrefs.size(); vertex_i++) {
+			if (xrefs[vertex_i] < 0 || xrefs[vertex_i] >= p_surfaces[surface_i].vertices.size()) {
+				return false;
+			}
+			xatlas::Vertex &vertex = vertices[vertex_i];
+			vertex = {};
+			vertex.uv[0] = uvs[vertex_i * 2 + 0];
+			vertex.uv[1] = uvs[vertex_i * 2 + 1];
+			vertex.xref = xrefs[vertex_i];
+		}
+		r_layout.indices[mesh_i].resize(indices.size());
+		for (int32_t index_i = 0; index_i < indices.size(); index_i++) {
+			if (indices[index_i] < 0 || indices[index_i] >= xrefs.size()) {
+				return false;
+			}
+			r_layout.indices[mesh_i][index_i] = indices[index_i];
+		}
+		r_layout.charts[mesh_i].resize(chart_faces.size());
+		for (int32_t chart_i = 0; chart_i < chart_faces.size(); chart_i++) {
+			const PackedInt32Array faces = chart_faces[chart_i];
+			for (const int32_t face : faces) {
+				if (face < 0 || face >= indices.size() / 3) {
+					return false;
+				}
+				r_layout.chart_faces[mesh_i].push_back(face);
+			}
+			xatlas::Chart &chart = r_layout.charts[mesh_i][chart_i];
+			chart = {};
+			chart.faceCount = faces.size();
+			chart.material = chart_materials[chart_i];
+		}
+		chart_count += chart_faces.size();
+	}
+	for (uint32_t mesh_i = 0; mesh_i < r_layout.meshes.size(); mesh_i++) {
+		uint32_t face_offset = 0;
+		for (xatlas::Chart &chart : r_layout.charts[mesh_i]) {
+			chart.faceArray = r_layout.chart_faces[mesh_i].ptr() + face_offset;
+			face_offset += chart.faceCount;
+		}
+		xatlas::Mesh &mesh = r_layout.meshes[mesh_i];
+		mesh = {};
+		mesh.chartArray = r_layout.charts[mesh_i].ptr();
+		mesh.chartCount = r_layout.charts[mesh_i].size();
+		mesh.indexArray = r_layout.indices[mesh_i].ptr();
+		mesh.indexCount = r_layout.indices[mesh_i].size();
+		mesh.vertexArray = r_layout.vertices[mesh_i].ptr();
+		mesh.vertexCount = r_layout.vertices[mesh_i].size();
+	}
+	r_layout.atlas = {};
+	r_layout.atlas.meshes = r_layout.meshes.ptr();
+	r_layout.atlas.meshCount = r_layout.meshes.size();
+	r_layout.atlas.chartCount = chart_count;
+	r_layout.atlas.atlasCount = layout.get("atlas_count", 0);
+	r_layout.atlas.width = layout.get("width", 0);
+	r_layout.atlas.height = layout.get("height", 0);
+	r_atlas_surfaces.clear();
+	for (const int32_t surface_i : atlas_surfaces) {
+		r_atlas_surfaces.push_back(surface_i);
+	}
+	return true;
+}
+
+void MeshTextureAtlas::_save_cached_layout(const String &p_cache_path, const xatlas::Atlas *p_atlas, const LocalVector<int32_t> &p_atlas_surfaces) {
+	if (p_cache_path.is_empty()) {
+		return;
+	}
+	// Only what the rasterization and the output mesh read from the xatlas output is kept.
+	Array meshes;
+	PackedInt32Array atlas_surfaces;
+	for (uint32_t mesh_i = 0; mesh_i < p_atlas->meshCount; mesh_i++) {
+		const xatlas::Mesh &mesh = p_atlas->meshes[mesh_i];
+		PackedFloat32Array uvs;
+		PackedInt32Array xrefs;
+		uvs.resize(mesh.vertexCount * 2);
+		xrefs.resize(mesh.vertexCount);
+		for (uint32_t vertex_i = 0; vertex_i < mesh.vertexCount; vertex_i++) {
+			uvs.set(vertex_i * 2 + 0, mesh.vertexArray[vertex_i].uv[0]);
+			uvs.set(vertex_i * 2 + 1, mesh.vertexArray[vertex_i].uv[1]);
+			xrefs.set(vertex_i, mesh.vertexArray[vertex_i].xref);
+		}
+		PackedInt32Array indices;
+		indices.resize(mesh.indexCount);
+		for (uint32_t index_i = 0; index_i < mesh.indexCount; index_i++) {
+			indices.set(index_i, mesh.indexArray[index_i]);
+		}
+		PackedInt32Array chart_materials;
+		Array chart_faces;
+		for (uint32_t chart_i = 0; chart_i < mesh.chartCount; chart_i++) {
+			const xatlas::Chart &chart = mesh.chartArray[chart_i];
+			PackedInt32Array faces;
+			faces.resize(chart.faceCount);
+			for (uint32_t face_i = 0; face_i < chart.faceCount; face_i++) {
+				faces.set(face_i, chart.faceArray[face_i]);
+			}
+			chart_materials.push_back(chart.material);
+			chart_faces.push_back(faces);
+		}
+		Dictionary mesh_data;
+		mesh_data["uvs"] = uvs;
+		mesh_data["xrefs"] = xrefs;
+		mesh_data["indices"] = indices;
+		mesh_data["chart_materials"] = chart_materials;
+		mesh_data["chart_faces"] = chart_faces;
+		meshes.push_back(mesh_data);
+		atlas_surfaces.push_back(p_atlas_surfaces[mesh_i]);
+	}
+	Dictionary layout;
+	layout["width"] = p_atlas->width;
+	layout["height"] = p_atlas->height;
+	layout["atlas_count"] = p_atlas->atlasCount;
+	layout["surfaces"] = atlas_surfaces;
+	layout["meshes"] = meshes;
+	Error err = DirAccess::make_dir_recursive_absolute(p_cache_path.get_base_dir());
+	ERR_FAIL_COND_MSG(err != OK && err != ERR_ALREADY_EXISTS, "Cannot create the layout cache directory: " + p_cache_path.get_base_dir());
+	Ref<FileAccess> file = FileAccess::open(p_cache_path, FileAccess::WRITE, &err);
+	ERR_FAIL_COND_MSG(file.is_null(), "Cannot save the layout cache: " + p_cache_path);
+	file->store_var(layout);
+}
+
+void MeshTextureAtlas::AtlasLookupTiles::create(uint32_t p_width, uint32_t p_height) {
+	width = p_width;
+	height = p_height;
+	tiles_x = (p_width + TILE_MASK) >> TILE_SHIFT;
+	tiles_y = (p_height + TILE_MASK) >> TILE_SHIFT;
+	tiles.clear();
+	tiles.resize(tiles_x * tiles_y);
+}
+
+void MeshTextureAtlas::AtlasLookupTiles::reserve(const Rect2i &p_rect) {
+	const Rect2i rect = p_rect.intersection(Rect2i(0, 0, width, height));
+	if (!rect.has_area()) {
+		return;
+	}
+	const Point2i end = rect.get_end() - Point2i(1, 1);
+	for (uint32_t tile_y = rect.position.y >> TILE_SHIFT; tile_y <= uint32_t(end.y) >> TILE_SHIFT; tile_y++) {
+		for (uint32_t tile_x = rect.position.x >> TILE_SHIFT; tile_x <= uint32_t(end.x) >> TILE_SHIFT; tile_x++) {
+			LocalVector<AtlasLookupTexel> &tile = tiles[tile_y * tiles_x + tile_x];
+			if (tile.is_empty()) {
+				tile.resize(TILE_SIZE * TILE_SIZE);
+			}
+		}
+	}
+}
+
+uint32_t MeshTextureAtlas::AtlasLookupTiles::get_allocated_tile_count() const {
+	uint32_t count = 0;
+	for (const LocalVector<AtlasLookupTexel> &tile : tiles) {
+		count += tile.is_empty() ? 0 : 1;
+	}
+	return count;
+}
+
+uint16_t MeshTextureAtlas::MaterialRegistry::add(const Ref<Material> &p_material) {
+	ERR_FAIL_COND_V(p_material.is_null(), INVALID_MATERIAL_ID);
+	HashMap<ObjectID, uint16_t>::ConstIterator E = ids.find(p_material->get_instance_id());
+	if (E) {
+		return E->value;
+	}
+	if (materials.size() >= INVALID_MATERIAL_ID) {
+		return INVALID_MATERIAL_ID;
+	}
+	const uint16_t id = materials.size();
+	materials.push_back(p_material);
+	ids.insert(p_material->get_instance_id(), id);
+	return id;
+}
+
+uint16_t MeshTextureAtlas::MaterialRegistry::find(const Ref<Material> &p_material) const {
+	if (p_material.is_null()) {
+		return INVALID_MATERIAL_ID;
+	}
+	HashMap<ObjectID, uint16_t>::ConstIterator E = ids.find(p_material->get_instance_id());
+	return E ? E->value : INVALID_MATERIAL_ID;
+}
+
+bool MeshTextureAtlas::AtlasLookupTiles::has_allocated_tiles(const Rect2i &p_rect) const {
+	const Rect2i rect = p_rect.intersection(Rect2i(0, 0, width, height));
+	if (!rect.has_area()) {
+		return false;
+	}
+	const Point2i end = rect.get_end() - Point2i(1, 1);
+	for (uint32_t tile_y = rect.position.y >> TILE_SHIFT; tile_y <= uint32_t(end.y) >> TILE_SHIFT; tile_y++) {
+		for (uint32_t tile_x = rect.position.x >> TILE_SHIFT; tile_x <= uint32_t(end.x) >> TILE_SHIFT; tile_x++) {
+			if (!tiles[tile_y * tiles_x + tile_x].is_empty()) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
 bool MeshTextureAtlas::MeshState::operator==(const MeshState &rhs) const {
-	if (rhs.mesh == mesh && rhs.path == path && rhs.mesh_instance == mesh_instance) {
+	if (rhs.mesh == mesh && rhs.surface_index == surface_index && rhs.path == path && rhs.mesh_instance == mesh_instance) {
 		return true;
 	}
 	return false;
@@ -589,6 +2296,13 @@ Pair<int, int> MeshTextureAtlas::calculate_coordinates(const Vector2 &p_source_u
 	int sx, sy;
 	sx = static_cast<int>(round(p_source_uv.x * p_width)) % p_width;
 	sy = static_cast<int>(round(p_source_uv.y * p_height)) % p_height;
+	// Wrap negative coordinates so tiled UVs stay inside the source texture.
+	if (sx < 0) {
+		sx += p_width;
+	}
+	if (sy < 0) {
+		sy += p_height;
+	}
 	return Pair<int, int>(sx, sy);
 }
 
@@ -613,15 +2327,10 @@ bool MeshTextureAtlas::MeshState::is_valid() const {
 	if (!is_mesh_valid || mesh_instance == nullptr) {
 		return false;
 	}
-	int num_surfaces = mesh->get_surface_count();
-	for (int i = 0; i < num_surfaces; ++i) {
-		int num_vertices = mesh->surface_get_array_len(i);
-		int num_indices = mesh->surface_get_array_index_len(i);
-		if (num_vertices == 0 || num_indices == 0) {
-			return false;
-		}
+	if (surface_index < 0 || surface_index >= mesh->get_surface_count()) {
+		return false;
 	}
-	return true;
+	return mesh->surface_get_array_len(surface_index) != 0 && mesh->surface_get_array_index_len(surface_index) != 0;
 }
 
 MeshTextureAtlas::MeshTextureAtlas() {
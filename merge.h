@@ -48,16 +48,51 @@ Copyright NVIDIA Corporation 2006 -- Ignacio Castano <icastano@nvidia.com>
 
 #include "core/object/ref_counted.h"
 
+#include "core/math/rect2i.h"
 #include "core/math/vector2.h"
 #include "core/object/ref_counted.h"
+#include "core/templates/local_vector.h"
 #include "scene/3d/mesh_instance_3d.h"
 #include "scene/main/node.h"
 
 #include "thirdparty/xatlas/xatlas.h"
 #include <cstdint>
+#include <cstring>
 
 class MeshTextureAtlas {
 public:
+	static constexpr float TEXEL_SIZE = 5.0f;
+	static constexpr uint16_t INVALID_MATERIAL_ID = UINT16_MAX;
+	// Streamed atlases are written to disk as square tiles, each resolved and bled with an apron of its neighbours.
+	static constexpr uint32_t STREAM_TILE_SIZE = 1024;
+	static constexpr uint32_t STREAM_TILE_APRON = 16;
+	static constexpr int32_t STREAM_ATLAS_RESOLUTION = 16 * 1024;
+	// Texels with alpha above this bleed into the empty texels around them.
+	static constexpr uint8_t BLEED_THRESHOLD = 128;
+	// Materials without textures share a palette block of the atlas, one cell of this size per material.
+	// Cells are aligned to their size, so a cell stays a single colour down to the mip level where it is one texel.
+	static constexpr int32_t PALETTE_CELL_SIZE = 16;
+	static constexpr int32_t PALETTE_MAX_ROW_CELLS = 256;
+	// Part of the merge cache key, bump it when a change to the merge alters its output for the same input.
+	static constexpr int32_t MERGE_CACHE_VERSION = 8;
+
+	// Options of a merge, set through SceneMerge.
+	struct MergeOptions {
+		// When set, atlas channels are streamed to tiles in this directory instead of being kept as images.
+		String tile_output_path;
+		// Directory of the merge and unwrap caches, empty uses scene_merge under the project data path.
+		String cache_path;
+		// Packing stops at the first tier whose atlas utilization reaches this.
+		float target_utilization = 0.75f;
+		// Brute force packing is the last tier, it is only tried when the faster tiers fall short of the target.
+		bool brute_force_packing = true;
+		// Instances are clustered into merge groups by grid cells of this size, each group gets its own mesh and atlas. 0 keeps one group.
+		float cluster_cell_size = 0.0f;
+		// A group is split further when it would exceed these budgets, 0 disables a budget.
+		int64_t cluster_max_triangles = 0;
+		int64_t cluster_max_texels = 0;
+	};
+
 	struct TextureData {
 		uint16_t width;
 		uint16_t height;
@@ -69,16 +104,61 @@ public:
 		Vector3 normal;
 		Vector2 uv;
 	};
+	// One surface of a mesh instance.
 	struct MeshState {
 		Ref<Mesh> mesh;
+		int32_t surface_index = 0;
 		NodePath path;
 		int32_t index_offset = 0;
-		MeshInstance3D *mesh_instance;
+		MeshInstance3D *mesh_instance = nullptr;
 		bool operator==(const MeshState &rhs) const;
 		bool is_valid() const;
 	};
+	// Read-only copy of the surface arrays, taken once after unwrapping and shared by every later stage.
+	struct SurfaceSnapshot {
+		PackedVector3Array vertices;
+		PackedVector3Array normals;
+		PackedVector2Array uvs;
+		PackedVector2Array uv2s;
+		PackedInt32Array indices;
+		Transform3D transform;
+		uint16_t material_id = INVALID_MATERIAL_ID;
+	};
+	// Materials of a merge indexed by their compact id, with O(1) material to id lookup.
+	struct MaterialRegistry {
+		Vector<Ref<Material> > materials;
+		HashMap<ObjectID, uint16_t> ids;
+
+		uint16_t add(const Ref<Material> &p_material);
+		uint16_t find(const Ref<Material> &p_material) const;
+		Ref<Material> get(int32_t p_id) const { return p_id >= 0 && p_id < materials.size() ? materials[p_id] : Ref<Material>(); }
+		int32_t size() const { return materials.size(); }
+	};
+	// Source images of one material, every image shares one size so a single lookup texel addresses them all.
 	struct MaterialImageCache {
 		Ref<Image> albedo_img;
+		Ref<Image> normal_img;
+		Ref<Image> orm_img;
+		Ref<Image> emission_img;
+		// Texel used for a channel when the material has no texture for it.
+		Color albedo_color = Color(1.0, 1.0, 1.0);
+		Color normal_color = Color(0.5, 0.5, 1.0);
+		Color orm_color = Color(1.0, 1.0, 0.0);
+		Color emission_color = Color(0.0, 0.0, 0.0);
+	};
+	// Decoded source images of a merge, shared by every material that uses the same content.
+	// Byte-identical textures decode to one image, resized and tinted variants are derived from it once.
+	struct SourceImageCache {
+		LocalVector<Ref<Image> > images;
+		HashMap<ObjectID, int32_t> textures;
+		HashMap<uint32_t, LocalVector<int32_t> > contents;
+		HashMap<uint64_t, int32_t> resized;
+		HashMap<uint64_t, Ref<Image> > tinted;
+
+		// Returns -1 for textures without an image.
+		int32_t get_texture_image(const Ref<Texture2D> &p_texture);
+		int32_t get_resized_image(int32_t p_image, int32_t p_width, int32_t p_height);
+		Ref<Image> get_tinted_image(int32_t p_image, const Color &p_tint);
 	};
 	struct MeshMerge {
 		Vector<MeshState> meshes;
@@ -88,56 +168,281 @@ public:
 		Vector<MeshMerge> mesh_items;
 		Node *root = nullptr;
 	};
-	static constexpr float TEXEL_SIZE = 5.0f;
 
+	// Source texel of an atlas texel, material_index is INVALID_MATERIAL_ID where no chart was rasterized.
 	struct AtlasLookupTexel {
-		uint16_t material_index = 0;
+		uint16_t material_index = INVALID_MATERIAL_ID;
 		uint16_t x = 0;
 		uint16_t y = 0;
 	};
+	// Atlas lookup split into square tiles, only the tiles charts are reserved in are allocated.
+	// Reserving happens before rasterization, so chart tasks write texels without locking.
+	struct AtlasLookupTiles {
+		static constexpr uint32_t TILE_SHIFT = 6;
+		static constexpr uint32_t TILE_SIZE = 1 << TILE_SHIFT;
+		static constexpr uint32_t TILE_MASK = TILE_SIZE - 1;
+
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t tiles_x = 0;
+		uint32_t tiles_y = 0;
+		LocalVector<LocalVector<AtlasLookupTexel> > tiles;
+
+		void create(uint32_t p_width, uint32_t p_height);
+		void reserve(const Rect2i &p_rect);
+		uint32_t get_allocated_tile_count() const;
+		bool has_allocated_tiles(const Rect2i &p_rect) const;
+
+		// Returns nullptr outside the atlas and in tiles that were never reserved.
+		_FORCE_INLINE_ AtlasLookupTexel *get_texel(uint32_t p_x, uint32_t p_y) {
+			if (p_x >= width || p_y >= height) {
+				return nullptr;
+			}
+			LocalVector<AtlasLookupTexel> &tile = tiles[(p_y >> TILE_SHIFT) * tiles_x + (p_x >> TILE_SHIFT)];
+			return tile.is_empty() ? nullptr : &tile[((p_y & TILE_MASK) << TILE_SHIFT) | (p_x & TILE_MASK)];
+		}
+		_FORCE_INLINE_ const AtlasLookupTexel *get_texel(uint32_t p_x, uint32_t p_y) const {
+			return const_cast<AtlasLookupTiles *>(this)->get_texel(p_x, p_y);
+		}
+		// The TILE_SIZE texels of row p_y inside tile column p_tile_x, or nullptr when the tile is empty.
+		_FORCE_INLINE_ const AtlasLookupTexel *get_tile_row(uint32_t p_tile_x, uint32_t p_y) const {
+			const LocalVector<AtlasLookupTexel> &tile = tiles[(p_y >> TILE_SHIFT) * tiles_x + p_tile_x];
+			return tile.is_empty() ? nullptr : tile.ptr() + ((p_y & TILE_MASK) << TILE_SHIFT);
+		}
+	};
 	struct AtlasTextureArguments {
 		Ref<Image> atlas_data;
 		Ref<Image> source_texture;
-		AtlasLookupTexel *atlas_lookup = nullptr;
+		AtlasLookupTiles *atlas_lookup = nullptr;
 		uint16_t material_index = 0;
 		Vector2 source_uvs[3];
 		uint32_t atlas_width = 0;
 		uint32_t atlas_height = 0;
+		// Raw RGBA8 buffers, when set texels are copied directly instead of going through Image::get_pixel/set_pixel.
+		uint8_t *atlas_texels = nullptr;
+		const uint8_t *source_texels = nullptr;
+		int32_t source_width = 0;
+		int32_t source_height = 0;
+	};
+
+	// Writes texels from the raw RGBA8 buffers of AtlasTextureArguments, passed to MeshMergeTriangle::drawAA.
+	struct AtlasTexelSampler {
+		AtlasTextureArguments *args = nullptr;
+
+		_FORCE_INLINE_ bool operator()(int p_x, int p_y, const Vector3 &p_bar, float p_coverage) const {
+			if (static_cast<uint32_t>(p_x) >= args->atlas_width || static_cast<uint32_t>(p_y) >= args->atlas_height) {
+				return true;
+			}
+			AtlasLookupTexel *lookup = args->atlas_lookup->get_texel(p_x, p_y);
+			if (!lookup) {
+				return true;
+			}
+			const int32_t index = p_y * args->atlas_width + p_x;
+			const Vector2 source_uv = interpolate_source_uvs(p_bar, args);
+			const Pair<int, int> coordinates = calculate_coordinates(source_uv, args->source_width, args->source_height);
+			const uint8_t *source_texel = args->source_texels + (coordinates.second * args->source_width + coordinates.first) * 4;
+			memcpy(args->atlas_texels + index * 4, source_texel, 4);
+			lookup->material_index = args->material_index;
+			lookup->x = static_cast<uint16_t>(coordinates.first);
+			lookup->y = static_cast<uint16_t>(coordinates.second);
+			return true;
+		}
+	};
+
+	// Records only the source texel of each atlas texel, the channels are resolved from the lookup afterwards.
+	struct AtlasLookupSampler {
+		AtlasTextureArguments *args = nullptr;
+
+		_FORCE_INLINE_ bool operator()(int p_x, int p_y, const Vector3 &p_bar, float p_coverage) const {
+			AtlasLookupTexel *lookup = args->atlas_lookup->get_texel(p_x, p_y);
+			if (!lookup) {
+				return true;
+			}
+			const Vector2 source_uv = interpolate_source_uvs(p_bar, args);
+			const Pair<int, int> coordinates = calculate_coordinates(source_uv, args->source_width, args->source_height);
+			lookup->material_index = args->material_index;
+			lookup->x = static_cast<uint16_t>(coordinates.first);
+			lookup->y = static_cast<uint16_t>(coordinates.second);
+			return true;
+		}
+	};
+
+	// RGBA8 texels of one channel of one material, indexed by AtlasLookupTexel::material_index.
+	struct AtlasChannelSource {
+		const uint8_t *texels = nullptr;
+		int32_t width = 0;
+		int32_t height = 0;
+		uint8_t fallback[4] = { 0, 0, 0, 0 };
 	};
 
 	struct MergeState {
 		Node *p_root = nullptr;
 		xatlas::Atlas *atlas = nullptr;
 		Vector<MeshState> &r_mesh_items;
-		Array &vertex_to_material;
+		const Vector<SurfaceSnapshot> &surfaces;
 		const Vector<Vector<Vector2> > uvs;
 		const Vector<Vector<ModelVertex> > &model_vertices;
 		String p_name;
 		const xatlas::PackOptions &pack_options;
-		Vector<AtlasLookupTexel> &atlas_lookup;
-		Vector<Ref<Material> > &material_cache;
+		AtlasLookupTiles &atlas_lookup;
+		MaterialRegistry &material_cache;
 		HashMap<String, Ref<Image> > texture_atlas;
 		HashMap<int32_t, MaterialImageCache> material_image_cache;
+		// When set, atlas channels are streamed to tiles in this directory instead of being kept as images.
+		String tile_output_path;
+		HashMap<String, PackedStringArray> texture_atlas_tiles;
+		// Surface of every xatlas mesh, flat colour surfaces are not given to xatlas.
+		const LocalVector<int32_t> &atlas_surfaces;
+		// Palette cell of every flat colour material, empty for textured materials.
+		LocalVector<Rect2i> palette_cells;
+		SourceImageCache source_images;
+		// Untransformed position and surface of every output vertex, so moved instances are re-transformed without a merge.
+		PackedVector3Array output_local_vertices;
+		PackedInt32Array output_vertex_surfaces;
 	};
 	static bool set_atlas_texel(void *param, int x, int y, const Vector3 &bar, const Vector3 &dx, const Vector3 &dy, float coverage);
 	static Pair<int, int> calculate_coordinates(const Vector2 &sourceUv, int width, int height);
+	static Vector2 interpolate_source_uvs(const Vector3 &bar, const AtlasTextureArguments *args);
+	static uint64_t get_material_feature_key(const Ref<BaseMaterial3D> &p_material);
+	static void partition_mesh_items_by_material(Vector<MeshMerge> &r_items);
+	static void cluster_mesh_items(Vector<MeshMerge> &r_items, const MergeOptions &p_options);
+	static void snapshot_surfaces(const Vector<MeshState> &p_mesh_items, const Vector<uint16_t> &p_surface_material_ids, Vector<SurfaceSnapshot> &r_surfaces);
+	// Reserves the lookup tiles under every chart, then writes the source texel of each covered atlas texel.
+	static void rasterize_charts(const xatlas::Atlas *p_atlas, const Vector<Vector<Vector2> > &p_uvs, const LocalVector<int32_t> &p_atlas_surfaces, const LocalVector<Size2i> &p_source_sizes, bool p_use_threads, AtlasLookupTiles &r_lookup);
+	static void resolve_atlas_channel(const AtlasLookupTiles &p_lookup, const AtlasChannelSource *p_sources, uint32_t p_source_count, bool p_opaque, uint8_t *r_texels);
+	static void resolve_atlas_channel_region(const AtlasLookupTiles &p_lookup, const AtlasChannelSource *p_sources, uint32_t p_source_count, bool p_opaque, const Rect2i &p_region, uint8_t *r_texels);
+	static void bleed_texels(uint8_t *p_texels, int32_t p_width, int32_t p_height);
+	static void tint_texels(const uint8_t *p_source, uint8_t *r_texels, int32_t p_width, int32_t p_height, const Color &p_tint);
+	// Bakes emission like BaseMaterial3D: (texel * colour) * energy when multiplying, (texel + colour) * energy when adding.
+	static void bake_emission_texels(const uint8_t *p_source, uint8_t *r_texels, int32_t p_width, int32_t p_height, const Color &p_emission, float p_energy, bool p_multiply);
+	static void write_uvs(const Vector<SurfaceSnapshot> &p_surfaces, Vector<Vector<Vector2> > &uv_groups, Vector<Vector<ModelVertex> > &r_model_vertices);
 	MeshTextureAtlas();
-	static Node *merge_meshes(Node *p_root);
+	static Node *merge_meshes(Node *p_root, const MergeOptions &p_options = MergeOptions());
+	static float get_atlas_utilization(const xatlas::Atlas *p_atlas);
 
 private:
+	struct ChartRasterizeData {
+		struct Chart {
+			uint32_t mesh_index = 0;
+			uint32_t chart_index = 0;
+		};
+		const xatlas::Atlas *atlas = nullptr;
+		AtlasLookupTiles *atlas_lookup = nullptr;
+		const Vector<Vector<Vector2> > *uvs = nullptr;
+		const int32_t *atlas_surfaces = nullptr;
+		const Size2i *source_sizes = nullptr;
+		const Chart *charts = nullptr;
+	};
+	struct UvMeshInputData {
+		const SurfaceSnapshot *surfaces = nullptr;
+		const int32_t *atlas_surfaces = nullptr;
+		LocalVector<float> *uv_data = nullptr;
+		LocalVector<uint32_t> *face_materials = nullptr;
+	};
+	struct OutputMeshData {
+		const MergeState *state = nullptr;
+		const int32_t *part_surfaces = nullptr;
+		const int32_t *vertex_offsets = nullptr;
+		const int32_t *index_offsets = nullptr;
+		Vector3 *positions = nullptr;
+		Vector3 *normals = nullptr;
+		Vector2 *uvs = nullptr;
+		int32_t *indices = nullptr;
+		Vector3 *local_vertices = nullptr;
+		int32_t *vertex_surfaces = nullptr;
+	};
+	struct UnwrapData {
+		Ref<ArrayMesh> *meshes = nullptr;
+		Error *errors = nullptr;
+	};
+	// A packed chart layout read back from the layout cache. It is laid out like the xatlas output, so the merge reads both alike.
+	struct CachedAtlasLayout {
+		xatlas::Atlas atlas = {};
+		LocalVector<xatlas::Mesh> meshes;
+		LocalVector<LocalVector<xatlas::Vertex> > vertices;
+		LocalVector<LocalVector<uint32_t> > indices;
+		LocalVector<LocalVector<xatlas::Chart> > charts;
+		LocalVector<LocalVector<uint32_t> > chart_faces;
+	};
+	struct XatlasProgressData {
+		static const int32_t CATEGORY_COUNT = int32_t(xatlas::ProgressCategory::BuildOutputMeshes) + 1;
+		uint64_t begin_usec[CATEGORY_COUNT] = {};
+	};
+	struct ChannelResolveData {
+		const AtlasLookupTiles *lookup = nullptr;
+		const AtlasChannelSource *sources = nullptr;
+		uint32_t source_count = 0;
+		bool opaque = false;
+		Rect2i region;
+		uint8_t *texels = nullptr;
+	};
+	// Nearest solid row of every texel within its column, shared by the two passes of bleed_texels.
+	struct BleedData {
+		static constexpr uint16_t NONE = UINT16_MAX;
+		static constexpr int32_t STRIP_WIDTH = 64;
+		uint8_t *texels = nullptr;
+		int32_t width = 0;
+		int32_t height = 0;
+		uint16_t *nearest_rows = nullptr;
+	};
+	struct TintData {
+		const uint8_t *source = nullptr;
+		uint8_t *texels = nullptr;
+		int32_t width = 0;
+		uint8_t tint[4] = { 255, 255, 255, 255 };
+	};
+	static void _tint_row_task(void *p_userdata, uint32_t p_row);
+	struct EmissionBakeData {
+		const uint8_t *source = nullptr;
+		uint8_t *texels = nullptr;
+		int32_t width = 0;
+		// Output of every source value, per colour channel.
+		uint8_t table[3][256] = {};
+	};
+	static void _bake_emission_row_task(void *p_userdata, uint32_t p_row);
+	static void _bleed_column_strip_task(void *p_userdata, uint32_t p_strip);
+	static void _bleed_row_task(void *p_userdata, uint32_t p_row);
+	static void _rasterize_chart_task(void *p_userdata, uint32_t p_index);
+	static void _resolve_channel_row_task(void *p_userdata, uint32_t p_row);
 	static int godot_xatlas_print(const char *p_print_string, ...);
-	static Vector2 interpolate_source_uvs(const Vector3 &bar, const AtlasTextureArguments *args);
-	static Ref<Image> dilate_image(Ref<Image> source_image);
+	static void dilate_image(const Ref<Image> &p_image, bool p_opaque = true);
 	static void _find_all_mesh_instances(Vector<MeshMerge> &r_items, Node *p_current_node, const Node *p_owner);
+	static bool _is_flat_color_material(const Ref<BaseMaterial3D> &p_material);
+	static void _layout_palette(MergeState &state, const LocalVector<bool> &p_flat_materials);
+	static void _rasterize_atlas_lookup(MergeState &state);
 	static void _generate_texture_atlas(MergeState &state, String texture_type);
-	static Ref<Image> _get_source_texture(MergeState &state, Ref<BaseMaterial3D> material);
-	static Error _generate_atlas(const int32_t p_num_meshes, Vector<Vector<Vector2> > &r_uvs, xatlas::Atlas *atlas, const Vector<MeshState> &r_meshes, const Vector<Ref<Material> > material_cache,
-			xatlas::PackOptions &pack_options);
-	static void write_uvs(const Vector<MeshState> &p_mesh_items, Vector<Vector<Vector2> > &uv_groups, Array &r_vertex_to_material, Vector<Vector<ModelVertex> > &r_model_vertices);
-	static void map_mesh_to_index_to_material(const Vector<MeshState> &mesh_items, Array &vertex_to_material, Vector<Ref<Material> > &material_cache);
-	static Node *_output_mesh_atlas(MergeState &state, int p_count);
+	static void _stream_texture_atlas(MergeState &state, const String &texture_type, const LocalVector<AtlasChannelSource> &sources);
+	static MaterialImageCache _get_source_textures(MergeState &state, Ref<BaseMaterial3D> material);
+	static void _uv_mesh_input_task(void *p_userdata, uint32_t p_index);
+	static bool _xatlas_progress(xatlas::ProgressCategory p_category, int p_progress, void *p_userdata);
+	static Error _generate_atlas(const Vector<SurfaceSnapshot> &p_surfaces, const LocalVector<bool> &p_flat_materials, const MergeOptions &p_options, xatlas::Atlas *atlas, xatlas::PackOptions &pack_options, LocalVector<int32_t> &r_atlas_surfaces);
+	static void _pack_charts(xatlas::Atlas *r_atlas, xatlas::PackOptions &r_pack_options, const MergeOptions &p_options);
+	static void map_surfaces_to_material_ids(const Vector<MeshState> &mesh_items, const String &p_cache_dir, Vector<uint16_t> &r_surface_material_ids, MaterialRegistry &material_cache);
+	static String _get_cache_dir(const MergeOptions &p_options);
+	static void _unwrap_mesh_task(void *p_userdata, uint32_t p_index);
+	static bool _has_valid_uv2(const Ref<ArrayMesh> &p_mesh);
+	static String _get_unwrap_cache_path(const String &p_cache_dir, const Ref<ArrayMesh> &p_mesh);
+	static bool _load_cached_unwrap(const String &p_cache_path, const Ref<ArrayMesh> &p_mesh);
+	static void _save_cached_unwrap(const String &p_cache_path, const Ref<ArrayMesh> &p_geometry);
+	static Ref<ArrayMesh> _copy_surface_geometry(const Ref<ArrayMesh> &p_mesh);
+	static void _replace_surface_geometry(const Ref<ArrayMesh> &p_mesh, const Ref<ArrayMesh> &p_geometry);
+	static Transform3D _get_merge_transform(const MeshInstance3D *p_mesh_instance);
+	static String _get_merge_cache_path(const Vector<MeshState> &p_mesh_items, const xatlas::PackOptions &p_pack_options, const MergeOptions &p_options);
+	static Ref<ArrayMesh> _load_cached_merge(const String &p_cache_path, const Vector<MeshState> &p_mesh_items);
+	static void _save_cached_merge(const String &p_cache_path, const Ref<ArrayMesh> &p_mesh, const PackedVector3Array &p_local_vertices, const PackedInt32Array &p_vertex_surfaces, const Array &p_transforms);
+	static String _get_layout_cache_path(const Vector<SurfaceSnapshot> &p_surfaces, const LocalVector<bool> &p_flat_materials, const xatlas::PackOptions &p_pack_options, const MergeOptions &p_options);
+	static bool _load_cached_layout(const String &p_cache_path, const Vector<SurfaceSnapshot> &p_surfaces, CachedAtlasLayout &r_layout, LocalVector<int32_t> &r_atlas_surfaces);
+	static void _save_cached_layout(const String &p_cache_path, const xatlas::Atlas *p_atlas, const LocalVector<int32_t> &p_atlas_surfaces);
+	static void _copy_material_features(const Ref<BaseMaterial3D> &p_source, const Ref<BaseMaterial3D> &r_material);
+	static bool _is_opaque_atlas_channel(const MergeState &state, const String &texture_type);
+	static void _replace_mesh_instances(const Vector<MeshState> &p_mesh_items);
+	static MeshInstance3D *_create_output_instance(const Ref<ArrayMesh> &p_mesh, const String &p_name);
+	static void _output_part_task(void *p_userdata, uint32_t p_index);
+	static MeshInstance3D *_output_mesh_atlas(MergeState &state, int p_count);
 
 protected:
+	// MergeOptions has no Variant conversion, the bound method merges with the default options.
+	static Node *_merge(Node *p_root);
 	static void _bind_methods();
 };
 
@@ -30,101 +30,94 @@
 
 #include "mesh_merge_triangle.h"
 
-MeshMergeClippedTriangle::MeshMergeClippedTriangle(const Vector2 &a, const Vector2 &b, const Vector2 &c) {
-	m_area = 0;
-	m_numVertices = 3;
-	m_activeVertexBuffer = 0;
-	m_verticesA[0] = a;
-	m_verticesA[1] = b;
-	m_verticesA[2] = c;
-	m_vertexBuffers[0] = m_verticesA;
-	m_vertexBuffers[1] = m_verticesB;
-}
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MESH_MERGE_TRIANGLE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MESH_MERGE_TRIANGLE_SSE2
+#endif
 
-void MeshMergeClippedTriangle::clipHorizontalPlane(float offset, float clipdirection) {
-	Vector2 *v = m_vertexBuffers[m_activeVertexBuffer];
-	m_activeVertexBuffer ^= 1;
-	Vector2 *v2 = m_vertexBuffers[m_activeVertexBuffer];
-	v[m_numVertices] = v[0];
-	float dy2, dy1 = offset - v[0].y;
-	int dy2in, dy1in = clipdirection * dy1 >= 0;
-	uint32_t p = 0;
-	for (uint32_t k = 0; k < m_numVertices; k++) {
-		dy2 = offset - v[k + 1].y;
-		dy2in = clipdirection * dy2 >= 0;
-		if (dy1in) {
-			v2[p++] = v[k];
-		}
-		if (dy1in + dy2in == 1) { // not both in/out
-			float dx = v[k + 1].x - v[k].x;
-			float dy = v[k + 1].y - v[k].y;
-			v2[p++] = Vector2(v[k].x + dy1 * (dx / dy), offset);
-		}
-		dy1 = dy2;
-		dy1in = dy2in;
-	}
-	m_numVertices = p;
+// Transposes an 8x8 bit matrix stored one byte per row (Hacker's Delight, 7-3).
+static inline uint64_t transpose_block_mask(uint64_t p_mask) {
+	uint64_t t = (p_mask ^ (p_mask >> 7)) & 0x00AA00AA00AA00AAULL;
+	p_mask = p_mask ^ t ^ (t << 7);
+	t = (p_mask ^ (p_mask >> 14)) & 0x0000CCCC0000CCCCULL;
+	p_mask = p_mask ^ t ^ (t << 14);
+	t = (p_mask ^ (p_mask >> 28)) & 0x00000000F0F0F0F0ULL;
+	p_mask = p_mask ^ t ^ (t << 28);
+	return p_mask;
 }
 
-void MeshMergeClippedTriangle::clipVerticalPlane(float offset, float clipdirection) {
-	Vector2 *v = m_vertexBuffers[m_activeVertexBuffer];
-	m_activeVertexBuffer ^= 1;
-	Vector2 *v2 = m_vertexBuffers[m_activeVertexBuffer];
-	v[m_numVertices] = v[0];
-	float dx2, dx1 = offset - v[0].x;
-	int dx2in, dx1in = clipdirection * dx1 >= 0;
-	uint32_t p = 0;
-	for (uint32_t k = 0; k < m_numVertices; k++) {
-		dx2 = offset - v[k + 1].x;
-		dx2in = clipdirection * dx2 >= 0;
-		if (dx1in) {
-			v2[p++] = v[k];
-		}
-		if (dx1in + dx2in == 1) { // not both in/out
-			float dx = v[k + 1].x - v[k].x;
-			float dy = v[k + 1].y - v[k].y;
-			v2[p++] = Vector2(offset, v[k].y + dx1 * (dy / dx));
+void MeshMergeTriangle::computeBlockCoverage(const float p_row_edges[3][BLOCK_SIZE], float p_inside, float p_outside, uint64_t &r_inside, uint64_t &r_partial) const {
+	// The edge functions are advanced one column at a time exactly like the scalar
+	// scan did, but with one SIMD lane per block row, so the masks are bit-identical.
+	uint64_t column_inside = 0;
+	uint64_t column_partial = 0;
+#if defined(MESH_MERGE_TRIANGLE_AVX2)
+	const __m256 inside = _mm256_set1_ps(p_inside);
+	const __m256 outside = _mm256_set1_ps(p_outside);
+	const __m256 step1 = _mm256_set1_ps(n1.x);
+	const __m256 step2 = _mm256_set1_ps(n2.x);
+	const __m256 step3 = _mm256_set1_ps(n3.x);
+	__m256 e1 = _mm256_loadu_ps(p_row_edges[0]);
+	__m256 e2 = _mm256_loadu_ps(p_row_edges[1]);
+	__m256 e3 = _mm256_loadu_ps(p_row_edges[2]);
+	for (int x = 0; x < BLOCK_SIZE; x++) {
+		if (x > 0) {
+			e1 = _mm256_add_ps(e1, step1);
+			e2 = _mm256_add_ps(e2, step2);
+			e3 = _mm256_add_ps(e3, step3);
 		}
-		dx1 = dx2;
-		dx1in = dx2in;
+		const __m256 in = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(e1, inside, _CMP_GE_OQ), _mm256_cmp_ps(e2, inside, _CMP_GE_OQ)), _mm256_cmp_ps(e3, inside, _CMP_GE_OQ));
+		const __m256 touching = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(e1, outside, _CMP_GE_OQ), _mm256_cmp_ps(e2, outside, _CMP_GE_OQ)), _mm256_cmp_ps(e3, outside, _CMP_GE_OQ));
+		column_inside |= uint64_t(_mm256_movemask_ps(in)) << (x * BLOCK_SIZE);
+		column_partial |= uint64_t(_mm256_movemask_ps(_mm256_andnot_ps(in, touching))) << (x * BLOCK_SIZE);
 	}
-	m_numVertices = p;
-}
-
-void MeshMergeClippedTriangle::computeAreaCentroid() {
-	Vector2 *v = m_vertexBuffers[m_activeVertexBuffer];
-	v[m_numVertices] = v[0];
-	m_area = 0;
-	float centroidx = 0, centroidy = 0;
-	for (uint32_t k = 0; k < m_numVertices; k++) {
-		// http://local.wasp.uwa.edu.au/~pbourke/geometry/polyarea/
-		float f = v[k].x * v[k + 1].y - v[k + 1].x * v[k].y;
-		m_area += f;
-		centroidx += f * (v[k].x + v[k + 1].x);
-		centroidy += f * (v[k].y + v[k + 1].y);
+#elif defined(MESH_MERGE_TRIANGLE_SSE2)
+	const __m128 inside = _mm_set1_ps(p_inside);
+	const __m128 outside = _mm_set1_ps(p_outside);
+	const __m128 step1 = _mm_set1_ps(n1.x);
+	const __m128 step2 = _mm_set1_ps(n2.x);
+	const __m128 step3 = _mm_set1_ps(n3.x);
+	for (int half = 0; half < BLOCK_SIZE; half += 4) {
+		__m128 e1 = _mm_loadu_ps(p_row_edges[0] + half);
+		__m128 e2 = _mm_loadu_ps(p_row_edges[1] + half);
+		__m128 e3 = _mm_loadu_ps(p_row_edges[2] + half);
+		for (int x = 0; x < BLOCK_SIZE; x++) {
+			if (x > 0) {
+				e1 = _mm_add_ps(e1, step1);
+				e2 = _mm_add_ps(e2, step2);
+				e3 = _mm_add_ps(e3, step3);
+			}
+			const __m128 in = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e1, inside), _mm_cmpge_ps(e2, inside)), _mm_cmpge_ps(e3, inside));
+			const __m128 touching = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e1, outside), _mm_cmpge_ps(e2, outside)), _mm_cmpge_ps(e3, outside));
+			column_inside |= uint64_t(_mm_movemask_ps(in)) << (x * BLOCK_SIZE + half);
+			column_partial |= uint64_t(_mm_movemask_ps(_mm_andnot_ps(in, touching))) << (x * BLOCK_SIZE + half);
+		}
 	}
-	m_area = 0.5f * fabsf(m_area);
-	if (m_area == 0) {
-		m_centroid = Vector2(0.0f, 0.0f);
-	} else {
-		m_centroid = Vector2(centroidx / (6 * m_area), centroidy / (6 * m_area));
+#else
+	for (int y = 0; y < BLOCK_SIZE; y++) {
+		float e1 = p_row_edges[0][y];
+		float e2 = p_row_edges[1][y];
+		float e3 = p_row_edges[2][y];
+		for (int x = 0; x < BLOCK_SIZE; x++) {
+			if (x > 0) {
+				e1 += n1.x;
+				e2 += n2.x;
+				e3 += n3.x;
+			}
+			const uint64_t bit = uint64_t(1) << (x * BLOCK_SIZE + y);
+			if (e1 >= p_inside && e2 >= p_inside && e3 >= p_inside) {
+				column_inside |= bit;
+			} else if (e1 >= p_outside && e2 >= p_outside && e3 >= p_outside) {
+				column_partial |= bit;
+			}
+		}
 	}
-}
-
-void MeshMergeClippedTriangle::clipAABox(float x0, float y0, float x1, float y1) {
-	clipVerticalPlane(x0, -1);
-	clipHorizontalPlane(y0, -1);
-	clipVerticalPlane(x1, 1);
-	clipHorizontalPlane(y1, 1);
-	computeAreaCentroid();
-}
-
-Vector2 MeshMergeClippedTriangle::centroid() {
-	return m_centroid;
-}
-
-float MeshMergeClippedTriangle::area() {
-	return m_area;
+#endif
+	r_inside = transpose_block_mask(column_inside);
+	r_partial = transpose_block_mask(column_partial);
 }
 
 MeshMergeTriangle::MeshMergeTriangle(const Vector2 &p_v0, const Vector2 &p_v1, const Vector2 &p_v2, const Vector3 &p_t0, const Vector3 &p_t1, const Vector3 &p_t2) {
@@ -190,103 +183,116 @@ void MeshMergeTriangle::computeUnitInwardNormals() {
 	n3 = n3 * (1.0f / sqrtf(n3.x * n3.x + n3.y * n3.y));
 }
 
-bool MeshMergeTriangle::drawAA(MeshMergeSamplingCallback cb, void *param) {
-	const float PX_INSIDE = 1.0f / sqrtf(2.0f);
-	const float PX_OUTSIDE = -1.0f / sqrtf(2.0f);
-	const float BK_SIZE = 8;
-	const float BK_INSIDE = sqrtf(BK_SIZE * BK_SIZE / 2.0f);
-	const float BK_OUTSIDE = -sqrtf(BK_SIZE * BK_SIZE / 2.0f);
-
-	// Bounding rectangle
-	float minx = floorf(MAX(MIN(v1.x, MIN(v2.x, v3.x)), 0.0f));
-	float miny = floorf(MAX(MIN(v1.y, MIN(v2.y, v3.y)), 0.0f));
-	float maxx = ceilf(MAX(v1.x, MAX(v2.x, v3.x)));
-	float maxy = ceilf(MAX(v1.y, MAX(v2.y, v3.y)));
-
-	// Align to texel centers
-	minx += 0.5f;
-	miny += 0.5f;
-	maxx += 0.5f;
-	maxy += 0.5f;
-
-	// Half-edge constants
-	float C1 = n1.x * (-v1.x) + n1.y * (-v1.y);
-	float C2 = n2.x * (-v2.x) + n2.y * (-v2.y);
-	float C3 = n3.x * (-v3.x) + n3.y * (-v3.y);
-
-	// Loop through blocks
-	for (float y0 = miny; y0 <= maxy; y0 += BK_SIZE) {
-		for (float x0 = minx; x0 <= maxx; x0 += BK_SIZE) {
-			// Corners of block
-			float xc = (x0 + (BK_SIZE - 1) / 2.0f);
-			float yc = (y0 + (BK_SIZE - 1) / 2.0f);
-
-			// Evaluate half-space functions
-			float aC = C1 + n1.x * xc + n1.y * yc;
-			float bC = C2 + n2.x * xc + n2.y * yc;
-			float cC = C3 + n3.x * xc + n3.y * yc;
+// Area of the unit pixel on the inner side of an edge, given the signed distance
+// from the pixel center and the absolute components of the edge unit normal.
+static inline float edge_pixel_coverage(float p_distance, float p_a, float p_b) {
+	if (p_a < p_b) {
+		SWAP(p_a, p_b);
+	}
+	const float half_extent = 0.5f * (p_a + p_b);
+	if (p_distance >= half_extent) {
+		return 1.0f;
+	}
+	if (p_distance <= -half_extent) {
+		return 0.0f;
+	}
+	// The edge cuts a corner of the pixel, the covered area is a triangle.
+	const float corner = 0.5f * (p_a - p_b);
+	if (p_distance < -corner) {
+		const float t = p_distance + half_extent;
+		return t * t / (2.0f * p_a * p_b);
+	}
+	if (p_distance > corner) {
+		const float t = half_extent - p_distance;
+		return 1.0f - t * t / (2.0f * p_a * p_b);
+	}
+	// The edge crosses two opposite sides, the covered area is a trapezoid.
+	return 0.5f + p_distance / p_a;
+}
 
-			// Skip block when outside an edge
-			if ((aC <= BK_OUTSIDE) || (bC <= BK_OUTSIDE) || (cC <= BK_OUTSIDE)) {
-				continue;
+// Area of the unit pixel centered at (x, y) on the inner side of all three edges.
+// The pixel square is clipped against each edge, at most one vertex is added per edge.
+static float clip_pixel_area(float p_x, float p_y, const Vector2 *const p_vertices[3], const Vector2 *const p_normals[3]) {
+	Vector2 polygons[2][8] = {
+		{ Vector2(p_x - 0.5f, p_y - 0.5f), Vector2(p_x + 0.5f, p_y - 0.5f), Vector2(p_x + 0.5f, p_y + 0.5f), Vector2(p_x - 0.5f, p_y + 0.5f) },
+	};
+	int count = 4;
+	int active = 0;
+	for (int i = 0; i < 3 && count > 0; i++) {
+		const Vector2 *in = polygons[active];
+		Vector2 *out = polygons[active ^ 1];
+		const Vector2 &n = *p_normals[i];
+		const Vector2 &v = *p_vertices[i];
+		int out_count = 0;
+		float d1 = n.dot(in[count - 1] - v);
+		for (int k = 0; k < count; k++) {
+			const Vector2 &a = in[(k + count - 1) % count];
+			const Vector2 &b = in[k];
+			const float d2 = n.dot(b - v);
+			if ((d1 >= 0.0f) != (d2 >= 0.0f)) {
+				out[out_count++] = a + (b - a) * (d1 / (d1 - d2));
 			}
+			if (d2 >= 0.0f) {
+				out[out_count++] = b;
+			}
+			d1 = d2;
+		}
+		count = out_count;
+		active ^= 1;
+	}
+	float area = 0.0f;
+	const Vector2 *polygon = polygons[active];
+	for (int k = 0; k < count; k++) {
+		area += polygon[k].cross(polygon[(k + 1) % count]);
+	}
+	return CLAMP(0.5f * fabsf(area), 0.0f, 1.0f);
+}
 
-			// Calculate initial texture coordinates
-			Vector3 texRow = t1 + dy * (y0 - v1.y) + dx * (x0 - v1.x);
-
-			// Accept whole block when totally covered
-			if ((aC >= BK_INSIDE) && (bC >= BK_INSIDE) && (cC >= BK_INSIDE)) {
-				for (float y = y0; y < y0 + BK_SIZE; y++) {
-					Vector3 tex = texRow;
-					for (float x = x0; x < x0 + BK_SIZE; x++) {
-						if (!cb(param, (int)x, (int)y, tex, dx, dy, 1.0f)) {
-							return false;
-						}
-						tex += dx;
-					}
-					texRow += dy;
-				}
-			} else { // Partially covered block
-				float CY1 = C1 + n1.x * x0 + n1.y * y0;
-				float CY2 = C2 + n2.x * x0 + n2.y * y0;
-				float CY3 = C3 + n3.x * x0 + n3.y * y0;
+float MeshMergeTriangle::computePixelCoverage(float p_x, float p_y) const {
+	// Separating axis test against the pixel sides, the edge tests follow below.
+	const float overlap_x = MIN(p_x + 0.5f, MAX(v1.x, MAX(v2.x, v3.x))) - MAX(p_x - 0.5f, MIN(v1.x, MIN(v2.x, v3.x)));
+	const float overlap_y = MIN(p_y + 0.5f, MAX(v1.y, MAX(v2.y, v3.y))) - MAX(p_y - 0.5f, MIN(v1.y, MIN(v2.y, v3.y)));
+	if (overlap_x <= 0.0f || overlap_y <= 0.0f) {
+		return 0.0f;
+	}
+	const Vector2 *const vertices[3] = { &v1, &v2, &v3 };
+	const Vector2 *const normals[3] = { &n1, &n2, &n3 };
+	float coverage = 1.0f;
+	int partial_edges = 0;
+	for (int i = 0; i < 3; i++) {
+		const Vector2 &n = *normals[i];
+		const float distance = n.x * (p_x - vertices[i]->x) + n.y * (p_y - vertices[i]->y);
+		const float edge_coverage = edge_pixel_coverage(distance, fabsf(n.x), fabsf(n.y));
+		if (edge_coverage <= 0.0f) {
+			return 0.0f;
+		}
+		if (edge_coverage < 1.0f) {
+			coverage = edge_coverage;
+			partial_edges++;
+		}
+	}
+	// A single edge crossing the pixel is exact in closed form. Pixels around a vertex
+	// or inside a sliver are crossed by several edges and are clipped instead.
+	if (partial_edges <= 1) {
+		return coverage;
+	}
+	return clip_pixel_area(p_x, p_y, vertices, normals);
+}
 
-				for (float y = y0; y < y0 + BK_SIZE; y++) {
-					float CX1 = CY1;
-					float CX2 = CY2;
-					float CX3 = CY3;
-					Vector3 tex = texRow;
+namespace {
+struct MeshMergeCallbackSampler {
+	MeshMergeSamplingCallback cb;
+	void *param;
+	const Vector3 &dx;
+	const Vector3 &dy;
 
-					for (float x = x0; x < x0 + BK_SIZE; x++) {
-						Vector3 tex2 = t1 + dx * (x - v1.x) + dy * (y - v1.y);
-						if (CX1 >= PX_INSIDE && CX2 >= PX_INSIDE && CX3 >= PX_INSIDE) {
-							// pixel completely covered
-							if (!cb(param, (int)x, (int)y, tex2, dx, dy, 1.0f)) {
-								return false;
-							}
-						} else if ((CX1 >= PX_OUTSIDE) && (CX2 >= PX_OUTSIDE) && (CX3 >= PX_OUTSIDE)) {
-							// triangle partially covers pixel. do clipping.
-							MeshMergeClippedTriangle ct(v1 - Vector2(x, y), v2 - Vector2(x, y), v3 - Vector2(x, y));
-							ct.clipAABox(-0.5, -0.5, 0.5, 0.5);
-							float area = ct.area();
-							if (area > 0.0f) {
-								if (!cb(param, (int)x, (int)y, tex2, dx, dy, 0.0f)) {
-									return false;
-								}
-							}
-						}
-						CX1 += n1.x;
-						CX2 += n2.x;
-						CX3 += n3.x;
-						tex += dx;
-					}
-					CY1 += n1.y;
-					CY2 += n2.y;
-					CY3 += n3.y;
-					texRow += dy;
-				}
-			}
-		}
+	bool operator()(int p_x, int p_y, const Vector3 &p_bar, float p_coverage) const {
+		return cb(param, p_x, p_y, p_bar, dx, dy, p_coverage);
 	}
-	return true;
+};
+} // namespace
+
+bool MeshMergeTriangle::drawAA(MeshMergeSamplingCallback cb, void *param) {
+	MeshMergeCallbackSampler sampler{ cb, param, dx, dy };
+	return drawAA(sampler);
 }
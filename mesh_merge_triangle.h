@@ -38,6 +38,8 @@
 typedef bool (*MeshMergeSamplingCallback)(void *param, int x, int y, const Vector3 &bar, const Vector3 &dx, const Vector3 &dy, float coverage);
 
 struct MeshMergeTriangle {
+	static constexpr int BLOCK_SIZE = 8;
+
 	MeshMergeTriangle(const Vector2 &v0, const Vector2 &v1, const Vector2 &v2, const Vector3 &t0, const Vector3 &t1, const Vector3 &t2);
 	/// Compute texture space deltas.
 	/// This method takes two edge vectors that form a basis, determines the
@@ -48,30 +50,147 @@ struct MeshMergeTriangle {
 	// compute unit inward normals for each edge.
 	void computeUnitInwardNormals();
 	bool drawAA(MeshMergeSamplingCallback cb, void *param);
+	/// Rasterize with a functor called as `bool (int x, int y, const Vector3 &bar, float coverage)`.
+	/// The call is resolved at compile time so the sampler inlines into the scan loop.
+	template <typename Sampler>
+	bool drawAA(Sampler &p_sampler);
+	/// Classify the pixels of a block given the edge functions at the start of each row.
+	/// Bit (row * BLOCK_SIZE + column) of r_inside is set for fully covered pixels
+	/// and of r_partial for pixels that need clipping.
+	void computeBlockCoverage(const float p_row_edges[3][BLOCK_SIZE], float p_inside, float p_outside, uint64_t &r_inside, uint64_t &r_partial) const;
+	/// Analytic coverage of the unit pixel centered at (x, y) by the triangle.
+	/// Returns 0 exactly when the triangle and the pixel share no area.
+	float computePixelCoverage(float p_x, float p_y) const;
 	Vector2 v1, v2, v3;
 	Vector2 n1, n2, n3; // unit inward normals
 	Vector3 t1, t2, t3;
 	Vector3 dx, dy;
 };
 
-class MeshMergeClippedTriangle {
-public:
-	MeshMergeClippedTriangle(const Vector2 &a, const Vector2 &b, const Vector2 &c);
-	void clipHorizontalPlane(float offset, float clipdirection);
-	void clipVerticalPlane(float offset, float clipdirection);
-	void computeAreaCentroid();
-	void clipAABox(float x0, float y0, float x1, float y1);
-	Vector2 centroid();
-	float area();
-
-private:
-	Vector2 m_verticesA[7 + 1];
-	Vector2 m_verticesB[7 + 1];
-	Vector2 *m_vertexBuffers[2];
-	uint32_t m_numVertices;
-	uint32_t m_activeVertexBuffer;
-	float m_area;
-	Vector2 m_centroid;
-};
+template <typename Sampler>
+bool MeshMergeTriangle::drawAA(Sampler &p_sampler) {
+	const float PX_INSIDE = 1.0f / sqrtf(2.0f);
+	const float PX_OUTSIDE = -1.0f / sqrtf(2.0f);
+	const float BK_SIZE = BLOCK_SIZE;
+	const float BK_INSIDE = sqrtf(BK_SIZE * BK_SIZE / 2.0f);
+	const float BK_OUTSIDE = -sqrtf(BK_SIZE * BK_SIZE / 2.0f);
+
+	// Nothing covers any pixel area when the triangle is degenerate.
+	const float doubleArea = (v3.x - v1.x) * (v2.y - v1.y) - (v3.y - v1.y) * (v2.x - v1.x);
+	if (!(doubleArea > 0.0f) || !Math::is_finite(doubleArea)) {
+		return true;
+	}
+
+	// Bounding rectangle
+	float minx = floorf(MAX(MIN(v1.x, MIN(v2.x, v3.x)), 0.0f));
+	float miny = floorf(MAX(MIN(v1.y, MIN(v2.y, v3.y)), 0.0f));
+	float maxx = ceilf(MAX(v1.x, MAX(v2.x, v3.x)));
+	float maxy = ceilf(MAX(v1.y, MAX(v2.y, v3.y)));
+
+	// Align to texel centers
+	minx += 0.5f;
+	miny += 0.5f;
+	maxx += 0.5f;
+	maxy += 0.5f;
+
+	// Half-edge constants
+	float C1 = n1.x * (-v1.x) + n1.y * (-v1.y);
+	float C2 = n2.x * (-v2.x) + n2.y * (-v2.y);
+	float C3 = n3.x * (-v3.x) + n3.y * (-v3.y);
+
+	// Loop through blocks
+	for (float y0 = miny; y0 <= maxy; y0 += BK_SIZE) {
+		for (float x0 = minx; x0 <= maxx; x0 += BK_SIZE) {
+			// Corners of block
+			float xc = (x0 + (BK_SIZE - 1) / 2.0f);
+			float yc = (y0 + (BK_SIZE - 1) / 2.0f);
+
+			// Evaluate half-space functions
+			float aC = C1 + n1.x * xc + n1.y * yc;
+			float bC = C2 + n2.x * xc + n2.y * yc;
+			float cC = C3 + n3.x * xc + n3.y * yc;
+
+			// Skip block when outside an edge
+			if ((aC <= BK_OUTSIDE) || (bC <= BK_OUTSIDE) || (cC <= BK_OUTSIDE)) {
+				continue;
+			}
+
+			// Calculate initial texture coordinates
+			Vector3 texRow = t1 + dy * (y0 - v1.y) + dx * (x0 - v1.x);
+
+			// Accept whole block when totally covered
+			if ((aC >= BK_INSIDE) && (bC >= BK_INSIDE) && (cC >= BK_INSIDE)) {
+				for (float y = y0; y < y0 + BK_SIZE; y++) {
+					Vector3 tex = texRow;
+					for (float x = x0; x < x0 + BK_SIZE; x++) {
+						if (!p_sampler((int)x, (int)y, tex, 1.0f)) {
+							return false;
+						}
+						tex += dx;
+					}
+					texRow += dy;
+				}
+			} else { // Partially covered block
+				float row_edges[3][BLOCK_SIZE];
+				float CY1 = C1 + n1.x * x0 + n1.y * y0;
+				float CY2 = C2 + n2.x * x0 + n2.y * y0;
+				float CY3 = C3 + n3.x * x0 + n3.y * y0;
+				for (int row = 0; row < BLOCK_SIZE; row++) {
+					row_edges[0][row] = CY1;
+					row_edges[1][row] = CY2;
+					row_edges[2][row] = CY3;
+					CY1 += n1.y;
+					CY2 += n2.y;
+					CY3 += n3.y;
+				}
+				uint64_t inside_mask = 0;
+				uint64_t partial_mask = 0;
+				computeBlockCoverage(row_edges, PX_INSIDE, PX_OUTSIDE, inside_mask, partial_mask);
+				if ((inside_mask | partial_mask) == 0) {
+					continue;
+				}
+
+				// Texture coordinates split into per column and per row terms.
+				Vector3 texColumn[BLOCK_SIZE];
+				Vector3 texRowOffset[BLOCK_SIZE];
+				float x = x0;
+				float y = y0;
+				for (int i = 0; i < BLOCK_SIZE; i++) {
+					texColumn[i] = t1 + dx * (x - v1.x);
+					texRowOffset[i] = dy * (y - v1.y);
+					x++;
+					y++;
+				}
+
+				y = y0;
+				for (int row = 0; row < BLOCK_SIZE; row++, y++) {
+					const uint32_t row_inside = (inside_mask >> (row * BLOCK_SIZE)) & 0xFF;
+					const uint32_t row_partial = (partial_mask >> (row * BLOCK_SIZE)) & 0xFF;
+					x = x0;
+					for (int column = 0; column < BLOCK_SIZE; column++, x++) {
+						const uint32_t bit = 1u << column;
+						if (row_inside & bit) {
+							// pixel completely covered
+							Vector3 tex2 = texColumn[column] + texRowOffset[row];
+							if (!p_sampler((int)x, (int)y, tex2, 1.0f)) {
+								return false;
+							}
+						} else if (row_partial & bit) {
+							// triangle partially covers pixel.
+							const float coverage = computePixelCoverage(x, y);
+							if (coverage > 0.0f) {
+								Vector3 tex2 = texColumn[column] + texRowOffset[row];
+								if (!p_sampler((int)x, (int)y, tex2, coverage)) {
+									return false;
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
 
 #endif // MESH_MERGE_TRIANGLE_H
@@ -30,8 +30,92 @@
 
 #include "scene_merge.h"
 
+#include "core/object/class_db.h"
 #include "modules/scene_merge/merge.h"
 
+void SceneMerge::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("set_tile_output_path", "path"), &SceneMerge::set_tile_output_path);
+	ClassDB::bind_method(D_METHOD("get_tile_output_path"), &SceneMerge::get_tile_output_path);
+	ClassDB::bind_method(D_METHOD("set_cache_path", "path"), &SceneMerge::set_cache_path);
+	ClassDB::bind_method(D_METHOD("get_cache_path"), &SceneMerge::get_cache_path);
+	ClassDB::bind_method(D_METHOD("set_target_packing_utilization", "utilization"), &SceneMerge::set_target_packing_utilization);
+	ClassDB::bind_method(D_METHOD("get_target_packing_utilization"), &SceneMerge::get_target_packing_utilization);
+	ClassDB::bind_method(D_METHOD("set_brute_force_packing", "enabled"), &SceneMerge::set_brute_force_packing);
+	ClassDB::bind_method(D_METHOD("is_brute_force_packing"), &SceneMerge::is_brute_force_packing);
+	ClassDB::bind_method(D_METHOD("set_cluster_cell_size", "size"), &SceneMerge::set_cluster_cell_size);
+	ClassDB::bind_method(D_METHOD("get_cluster_cell_size"), &SceneMerge::get_cluster_cell_size);
+	ClassDB::bind_method(D_METHOD("set_cluster_max_triangles", "triangles"), &SceneMerge::set_cluster_max_triangles);
+	ClassDB::bind_method(D_METHOD("get_cluster_max_triangles"), &SceneMerge::get_cluster_max_triangles);
+	ClassDB::bind_method(D_METHOD("set_cluster_max_texels", "texels"), &SceneMerge::set_cluster_max_texels);
+	ClassDB::bind_method(D_METHOD("get_cluster_max_texels"), &SceneMerge::get_cluster_max_texels);
+	ClassDB::bind_method(D_METHOD("merge", "root"), &SceneMerge::merge);
+
+	ADD_PROPERTY(PropertyInfo(Variant::STRING, "tile_output_path", PROPERTY_HINT_GLOBAL_DIR), "set_tile_output_path", "get_tile_output_path");
+	ADD_PROPERTY(PropertyInfo(Variant::STRING, "cache_path", PROPERTY_HINT_GLOBAL_DIR), "set_cache_path", "get_cache_path");
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "target_packing_utilization", PROPERTY_HINT_RANGE, "0,1,0.01"), "set_target_packing_utilization", "get_target_packing_utilization");
+	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "brute_force_packing"), "set_brute_force_packing", "is_brute_force_packing");
+	ADD_GROUP("Clustering", "cluster_");
+	ADD_PROPERTY(PropertyInfo(Variant::FLOAT, "cluster_cell_size", PROPERTY_HINT_RANGE, "0,1000,0.1,or_greater,suffix:m"), "set_cluster_cell_size", "get_cluster_cell_size");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "cluster_max_triangles", PROPERTY_HINT_RANGE, "0,10000000,1,or_greater"), "set_cluster_max_triangles", "get_cluster_max_triangles");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "cluster_max_texels", PROPERTY_HINT_RANGE, "0,268435456,1,or_greater"), "set_cluster_max_texels", "get_cluster_max_texels");
+}
+
+void SceneMerge::set_tile_output_path(const String &p_path) {
+	options.tile_output_path = p_path;
+}
+
+String SceneMerge::get_tile_output_path() const {
+	return options.tile_output_path;
+}
+
+void SceneMerge::set_cache_path(const String &p_path) {
+	options.cache_path = p_path;
+}
+
+String SceneMerge::get_cache_path() const {
+	return options.cache_path;
+}
+
+void SceneMerge::set_target_packing_utilization(float p_utilization) {
+	options.target_utilization = CLAMP(p_utilization, 0.0f, 1.0f);
+}
+
+float SceneMerge::get_target_packing_utilization() const {
+	return options.target_utilization;
+}
+
+void SceneMerge::set_brute_force_packing(bool p_enabled) {
+	options.brute_force_packing = p_enabled;
+}
+
+bool SceneMerge::is_brute_force_packing() const {
+	return options.brute_force_packing;
+}
+
+void SceneMerge::set_cluster_cell_size(float p_size) {
+	options.cluster_cell_size = MAX(p_size, 0.0f);
+}
+
+float SceneMerge::get_cluster_cell_size() const {
+	return options.cluster_cell_size;
+}
+
+void SceneMerge::set_cluster_max_triangles(int64_t p_triangles) {
+	options.cluster_max_triangles = MAX(p_triangles, int64_t(0));
+}
+
+int64_t SceneMerge::get_cluster_max_triangles() const {
+	return options.cluster_max_triangles;
+}
+
+void SceneMerge::set_cluster_max_texels(int64_t p_texels) {
+	options.cluster_max_texels = MAX(p_texels, int64_t(0));
+}
+
+int64_t SceneMerge::get_cluster_max_texels() const {
+	return options.cluster_max_texels;
+}
+
 Node *SceneMerge::merge(Node *p_root_node) {
-	return MeshTextureAtlas::merge_meshes(p_root_node);
+	return MeshTextureAtlas::merge_meshes(p_root_node, options);
 }
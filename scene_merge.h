@@ -51,11 +51,32 @@ Copyright NVIDIA Corporation 2006 -- Ignacio Castano <icastano@nvidia.com>
 #include "core/object/ref_counted.h"
 #include "scene/main/node.h"
 
+#include "modules/scene_merge/merge.h"
+
 class SceneMerge : public RefCounted {
 private:
 	GDCLASS(SceneMerge, RefCounted);
+	MeshTextureAtlas::MergeOptions options;
+
+protected:
+	static void _bind_methods();
 
 public:
+	void set_tile_output_path(const String &p_path);
+	String get_tile_output_path() const;
+	void set_cache_path(const String &p_path);
+	String get_cache_path() const;
+	void set_target_packing_utilization(float p_utilization);
+	float get_target_packing_utilization() const;
+	void set_brute_force_packing(bool p_enabled);
+	bool is_brute_force_packing() const;
+	void set_cluster_cell_size(float p_size);
+	float get_cluster_cell_size() const;
+	void set_cluster_max_triangles(int64_t p_triangles);
+	int64_t get_cluster_max_triangles() const;
+	void set_cluster_max_texels(int64_t p_texels);
+	int64_t get_cluster_max_texels() const;
+
 	Node *merge(Node *p_root_node);
 };
 
@@ -32,6 +32,17 @@
 #define TEST_SCENE_MERGE_H
 
 #include "tests/test_macros.h"
+#include "tests/test_utils.h"
+
+#include "core/io/dir_access.h"
+#include "core/io/resource_loader.h"
+#include "core/io/resource_saver.h"
+#include "core/math/random_pcg.h"
+#include "core/templates/local_vector.h"
+#include "scene/3d/node_3d.h"
+#include "scene/resources/image_texture.h"
+#include "scene/resources/material.h"
+#include "scene/resources/primitive_meshes.h"
 
 #include "modules/scene_merge/merge.h"
 #include "modules/scene_merge/mesh_merge_triangle.h"
@@ -61,22 +72,1039 @@ TEST_CASE("[Modules][SceneMerge] MeshMergeTriangle drawAA") {
 	CHECK(triangle.drawAA(mock_callback, nullptr));
 }
 
+struct RecordedTexel {
+	int x = 0;
+	int y = 0;
+	Vector3 bar;
+	float coverage = 0.0f;
+};
+
+bool record_callback(void *param, int x, int y, const Vector3 &bar, const Vector3 &, const Vector3 &, float coverage) {
+	static_cast<LocalVector<RecordedTexel> *>(param)->push_back({ x, y, bar, coverage });
+	return true;
+}
+
+TEST_CASE("[Modules][SceneMerge] MeshMergeTriangle drawAA sampler matches callback") {
+	MeshMergeTriangle triangle(Vector2(0.3, 1.7), Vector2(40.2, 5.5), Vector2(12.9, 37.1), Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1));
+	LocalVector<RecordedTexel> expected;
+	CHECK(triangle.drawAA(record_callback, &expected));
+	CHECK(expected.size() > 0);
+
+	LocalVector<RecordedTexel> actual;
+	auto sampler = [&](int x, int y, const Vector3 &bar, float coverage) {
+		actual.push_back({ x, y, bar, coverage });
+		return true;
+	};
+	CHECK(triangle.drawAA(sampler));
+	REQUIRE(actual.size() == expected.size());
+	for (uint32_t i = 0; i < actual.size(); i++) {
+		CHECK(actual[i].x == expected[i].x);
+		CHECK(actual[i].y == expected[i].y);
+		CHECK(actual[i].bar == expected[i].bar);
+		CHECK(actual[i].coverage == expected[i].coverage);
+	}
+}
+
+// Area of the unit pixel centered at (x, y) covered by a triangle, by clipping the triangle to the pixel.
+static float clip_triangle_to_pixel(const Vector2 &p_a, const Vector2 &p_b, const Vector2 &p_c, float p_x, float p_y) {
+	LocalVector<Vector2> polygon;
+	polygon.push_back(p_a);
+	polygon.push_back(p_b);
+	polygon.push_back(p_c);
+	const float planes[4][3] = {
+		{ 0, p_x - 0.5f, 1 },
+		{ 1, p_y - 0.5f, 1 },
+		{ 0, p_x + 0.5f, -1 },
+		{ 1, p_y + 0.5f, -1 },
+	};
+	for (const float(&plane)[3] : planes) {
+		LocalVector<Vector2> clipped;
+		for (uint32_t k = 0; k < polygon.size(); k++) {
+			const Vector2 &start = polygon[k];
+			const Vector2 &end = polygon[(k + 1) % polygon.size()];
+			const float d_start = plane[2] * ((plane[0] ? start.y : start.x) - plane[1]);
+			const float d_end = plane[2] * ((plane[0] ? end.y : end.x) - plane[1]);
+			if (d_start >= 0.0f) {
+				clipped.push_back(start);
+			}
+			if ((d_start >= 0.0f) != (d_end >= 0.0f)) {
+				clipped.push_back(start + (end - start) * (d_start / (d_start - d_end)));
+			}
+		}
+		polygon = clipped;
+	}
+	double area = 0.0;
+	for (uint32_t k = 0; k < polygon.size(); k++) {
+		area += polygon[k].cross(polygon[(k + 1) % polygon.size()]);
+	}
+	return Math::abs(area) * 0.5;
+}
+
+TEST_CASE("[Modules][SceneMerge] MeshMergeTriangle pixel coverage matches an exact clip") {
+	// Known partial coverage: the diagonal of a right triangle halves the pixels it crosses.
+	MeshMergeTriangle right(Vector2(0, 0), Vector2(2, 0), Vector2(0, 2), Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1));
+	CHECK(right.computePixelCoverage(0.5, 0.5) == doctest::Approx(1.0));
+	CHECK(right.computePixelCoverage(1.5, 0.5) == doctest::Approx(0.5));
+	CHECK(right.computePixelCoverage(1.5, 1.5) == doctest::Approx(0.0));
+	MeshMergeTriangle corner(Vector2(0, 0), Vector2(1, 0), Vector2(0, 1), Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1));
+	CHECK(corner.computePixelCoverage(0.5, 0.5) == doctest::Approx(0.5));
+
+	const Vector2 triangles[][3] = {
+		// Edges crossing pixels at shallow and steep angles.
+		{ Vector2(0.3, 0.2), Vector2(15.7, 3.1), Vector2(6.4, 14.8) },
+		{ Vector2(2.0, 2.0), Vector2(14.0, 2.0), Vector2(2.0, 14.0) },
+		// Vertices inside pixels, several edges cross the same pixel.
+		{ Vector2(4.2, 4.7), Vector2(5.1, 4.3), Vector2(4.6, 5.4) },
+		{ Vector2(7.5, 7.5), Vector2(8.4, 7.6), Vector2(7.9, 8.3) },
+		{ Vector2(3.3, 9.9), Vector2(12.6, 10.1), Vector2(3.4, 10.3) },
+		// Slivers thinner than a pixel.
+		{ Vector2(0.5, 1.1), Vector2(15.5, 14.2), Vector2(0.6, 1.4) },
+		{ Vector2(8.05, 0.2), Vector2(8.25, 15.9), Vector2(8.1, 0.1) },
+		{ Vector2(1.0, 8.0), Vector2(15.0, 8.1), Vector2(8.0, 8.07) },
+	};
+	for (const Vector2(&vertices)[3] : triangles) {
+		MeshMergeTriangle triangle(vertices[0], vertices[1], vertices[2], Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1));
+		for (int32_t y = -1; y < 17; y++) {
+			for (int32_t x = -1; x < 17; x++) {
+				const float expected = clip_triangle_to_pixel(vertices[0], vertices[1], vertices[2], x + 0.5f, y + 0.5f);
+				const float coverage = triangle.computePixelCoverage(x + 0.5f, y + 0.5f);
+				CHECK(coverage == doctest::Approx(expected).epsilon(1e-4));
+				if (expected == 0.0f) {
+					CHECK_MESSAGE(coverage < 1e-6f, "Pixels the triangle only touches have no coverage.");
+				}
+			}
+		}
+	}
+}
+
+// The per-pixel scan computeBlockCoverage replaces, one edge function step per column.
+static void classify_block_scalar(const MeshMergeTriangle &p_triangle, const float p_row_edges[3][MeshMergeTriangle::BLOCK_SIZE], float p_inside, float p_outside, uint64_t &r_inside, uint64_t &r_partial) {
+	r_inside = 0;
+	r_partial = 0;
+	for (int row = 0; row < MeshMergeTriangle::BLOCK_SIZE; row++) {
+		float e1 = p_row_edges[0][row];
+		float e2 = p_row_edges[1][row];
+		float e3 = p_row_edges[2][row];
+		for (int column = 0; column < MeshMergeTriangle::BLOCK_SIZE; column++) {
+			if (column > 0) {
+				e1 += p_triangle.n1.x;
+				e2 += p_triangle.n2.x;
+				e3 += p_triangle.n3.x;
+			}
+			const uint64_t bit = uint64_t(1) << (row * MeshMergeTriangle::BLOCK_SIZE + column);
+			if (e1 >= p_inside && e2 >= p_inside && e3 >= p_inside) {
+				r_inside |= bit;
+			} else if (e1 >= p_outside && e2 >= p_outside && e3 >= p_outside) {
+				r_partial |= bit;
+			}
+		}
+	}
+}
+
+TEST_CASE("[Modules][SceneMerge] computeBlockCoverage masks match a scalar classification") {
+	const float px_inside = 1.0f / sqrtf(2.0f);
+	const float px_outside = -1.0f / sqrtf(2.0f);
+	// Only the column steps n1.x, n2.x and n3.x are read, the rest of the triangle does not matter.
+	MeshMergeTriangle triangle(Vector2(0, 0), Vector2(4, 0), Vector2(0, 4), Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1));
+	float *steps[3] = { &triangle.n1.x, &triangle.n2.x, &triangle.n3.x };
+	RandomPCG rng(42);
+	int32_t mismatches = 0;
+	int32_t inside_count = 0;
+	int32_t partial_count = 0;
+	for (int32_t iteration = 0; iteration < 20000; iteration++) {
+		// A quarter of the edge values sit exactly on each threshold, and every other block
+		// has zero steps, so those values reach the comparisons unchanged in every column.
+		float row_edges[3][MeshMergeTriangle::BLOCK_SIZE];
+		for (int edge = 0; edge < 3; edge++) {
+			for (int row = 0; row < MeshMergeTriangle::BLOCK_SIZE; row++) {
+				const uint32_t pick = rng.rand() % 4;
+				row_edges[edge][row] = pick == 0 ? px_inside : (pick == 1 ? px_outside : rng.randf() * 6.0f - 3.0f);
+			}
+		}
+		for (float *step : steps) {
+			*step = iteration % 2 == 0 ? 0.0f : rng.randf() * 2.0f - 1.0f;
+		}
+		uint64_t inside = 0;
+		uint64_t partial = 0;
+		triangle.computeBlockCoverage(row_edges, px_inside, px_outside, inside, partial);
+		uint64_t expected_inside = 0;
+		uint64_t expected_partial = 0;
+		classify_block_scalar(triangle, row_edges, px_inside, px_outside, expected_inside, expected_partial);
+		if (inside != expected_inside || partial != expected_partial) {
+			mismatches++;
+		}
+		for (int bit = 0; bit < 64; bit++) {
+			inside_count += (inside >> bit) & 1;
+			partial_count += (partial >> bit) & 1;
+		}
+	}
+	CHECK_MESSAGE(mismatches == 0, "The SIMD masks classify every pixel like the scalar scan.");
+	CHECK_MESSAGE(inside_count > 0, "Some pixels are classified as inside.");
+	CHECK_MESSAGE(partial_count > 0, "Some pixels are classified as partial.");
+}
+
 TEST_CASE("[Modules][SceneMerge] MeshMergeMeshInstanceWithMaterialAtlasTest") {
 	MeshTextureAtlas::AtlasTextureArguments args;
 	args.atlas_data = Image::create_empty(1024, 1024, false, Image::FORMAT_RGBA8);
 	args.atlas_data->fill(Color());
 	args.source_texture = Image::create_empty(1024, 1024, false, Image::FORMAT_RGBA8);
 	args.source_texture->fill(Color());
-	MeshTextureAtlas::AtlasLookupTexel lookup;
+	MeshTextureAtlas::AtlasLookupTiles lookup;
+	lookup.create(1024, 1024);
+	lookup.reserve(Rect2i(0, 0, 1024, 1024));
 	args.atlas_lookup = &lookup;
-	lookup.x = 512;
-	lookup.y = 512;
+	args.atlas_width = 1024;
+	args.atlas_height = 1024;
 	bool result = MeshTextureAtlas::set_atlas_texel(&args, 512, 512, Vector3(0.33, 0.33, 0.33), Vector3(), Vector3(), 0.0f);
 	CHECK(result);
-	lookup.x = 1023;
-	lookup.y = 1023;
 	result = MeshTextureAtlas::set_atlas_texel(&args, 1023, 1023, Vector3(0.33, 0.33, 0.33), Vector3(), Vector3(), 0.0f);
 	CHECK(result);
+	result = MeshTextureAtlas::set_atlas_texel(&args, 1024, 1024, Vector3(0.33, 0.33, 0.33), Vector3(), Vector3(), 0.0f);
+	CHECK_MESSAGE(result, "Texels outside of the atlas are skipped without stopping rasterization.");
+}
+
+TEST_CASE("[Modules][SceneMerge] Raw texel writer matches Image texel writer") {
+	Ref<Image> source = Image::create_empty(64, 64, false, Image::FORMAT_RGBA8);
+	for (int32_t y = 0; y < 64; y++) {
+		for (int32_t x = 0; x < 64; x++) {
+			source->set_pixel(x, y, Color(x / 64.0f, y / 64.0f, (x + y) / 128.0f));
+		}
+	}
+	MeshTextureAtlas::AtlasLookupTiles lookup;
+	lookup.create(32, 32);
+	lookup.reserve(Rect2i(0, 0, 32, 32));
+
+	MeshTextureAtlas::AtlasTextureArguments image_args;
+	image_args.atlas_data = Image::create_empty(32, 32, false, Image::FORMAT_RGBA8);
+	image_args.source_texture = source;
+	image_args.atlas_lookup = &lookup;
+	image_args.atlas_width = 32;
+	image_args.atlas_height = 32;
+	image_args.source_uvs[0] = Vector2(0, 0);
+	image_args.source_uvs[1] = Vector2(1, 0);
+	image_args.source_uvs[2] = Vector2(-0.5, 1);
+
+	MeshTextureAtlas::AtlasTextureArguments raw_args = image_args;
+	raw_args.atlas_data = Image::create_empty(32, 32, false, Image::FORMAT_RGBA8);
+	raw_args.atlas_texels = raw_args.atlas_data->ptrw();
+	raw_args.source_texels = source->ptr();
+	raw_args.source_width = source->get_width();
+	raw_args.source_height = source->get_height();
+
+	for (int32_t y = 0; y < 32; y++) {
+		for (int32_t x = 0; x < 32; x++) {
+			const Vector3 bar(x / 32.0f, y / 32.0f, 1.0f - x / 32.0f - y / 32.0f);
+			CHECK(MeshTextureAtlas::set_atlas_texel(&image_args, x, y, bar, Vector3(), Vector3(), 1.0f));
+			CHECK(MeshTextureAtlas::set_atlas_texel(&raw_args, x, y, bar, Vector3(), Vector3(), 1.0f));
+		}
+	}
+	CHECK(image_args.atlas_data->get_data() == raw_args.atlas_data->get_data());
+}
+
+TEST_CASE("[Modules][SceneMerge] MaterialRegistry assigns stable ids") {
+	MeshTextureAtlas::MaterialRegistry registry;
+	Ref<StandardMaterial3D> first;
+	first.instantiate();
+	Ref<StandardMaterial3D> second;
+	second.instantiate();
+
+	CHECK(registry.add(first) == 0);
+	CHECK(registry.add(second) == 1);
+	CHECK(registry.add(first) == 0);
+	CHECK(registry.size() == 2);
+	CHECK(registry.find(second) == 1);
+	CHECK(registry.get(1) == second);
+	CHECK(registry.find(Ref<Material>()) == MeshTextureAtlas::INVALID_MATERIAL_ID);
+	CHECK(registry.get(2).is_null());
+}
+
+TEST_CASE("[Modules][SceneMerge] Atlas channels resolve from the lookup") {
+	const uint8_t red[4] = { 255, 0, 0, 128 };
+	const uint8_t blue[4] = { 0, 0, 255, 255 };
+	MeshTextureAtlas::AtlasChannelSource sources[2];
+	sources[0].texels = red;
+	sources[0].width = 1;
+	sources[0].height = 1;
+	sources[1].fallback[1] = 200;
+
+	MeshTextureAtlas::AtlasLookupTiles lookup;
+	lookup.create(2, 2);
+	lookup.reserve(Rect2i(0, 0, 2, 2));
+	lookup.get_texel(0, 0)->material_index = 0;
+	lookup.get_texel(1, 0)->material_index = 1;
+	lookup.get_texel(1, 1)->material_index = 0;
+	lookup.get_texel(1, 1)->x = 5;
+	uint8_t texels[4 * 4] = {};
+	MeshTextureAtlas::resolve_atlas_channel(lookup, sources, 2, false, texels);
+
+	CHECK(memcmp(texels + 0, red, 4) == 0);
+	CHECK(texels[4 + 1] == 200);
+	CHECK_MESSAGE(texels[8 + 3] == 0, "Texels without a chart are left empty.");
+	CHECK_MESSAGE(memcmp(texels + 12, sources[0].fallback, 4) == 0, "Out of range source texels use the fallback.");
+
+	sources[1].texels = blue;
+	sources[1].width = 1;
+	sources[1].height = 1;
+	MeshTextureAtlas::resolve_atlas_channel(lookup, sources, 2, true, texels);
+	CHECK(texels[0 + 3] == 255);
+	CHECK(memcmp(texels + 4, blue, 4) == 0);
+}
+
+TEST_CASE("[Modules][SceneMerge] Atlas channel regions match the full resolve") {
+	const uint32_t tile_size = MeshTextureAtlas::AtlasLookupTiles::TILE_SIZE;
+	const uint8_t texel[4] = { 10, 20, 30, 40 };
+	MeshTextureAtlas::AtlasChannelSource source;
+	source.texels = texel;
+	source.width = 1;
+	source.height = 1;
+
+	MeshTextureAtlas::AtlasLookupTiles lookup;
+	lookup.create(tile_size * 2, tile_size * 2);
+	lookup.reserve(Rect2i(tile_size - 2, tile_size - 2, 4, 4));
+	lookup.get_texel(tile_size - 1, tile_size)->material_index = 0;
+	lookup.get_texel(tile_size, tile_size - 1)->material_index = 0;
+	CHECK(lookup.has_allocated_tiles(Rect2i(0, 0, tile_size, tile_size)));
+	CHECK_FALSE(lookup.has_allocated_tiles(Rect2i(0, 0, tile_size - 2, tile_size - 2)));
+
+	LocalVector<uint8_t> full;
+	full.resize(lookup.width * lookup.height * 4);
+	memset(full.ptr(), 0, full.size());
+	MeshTextureAtlas::resolve_atlas_channel(lookup, &source, 1, false, full.ptr());
+
+	const Rect2i region(tile_size - 3, tile_size - 3, 6, 6);
+	uint8_t texels[6 * 6 * 4] = {};
+	MeshTextureAtlas::resolve_atlas_channel_region(lookup, &source, 1, false, region, texels);
+	for (int32_t y = 0; y < region.size.y; y++) {
+		const uint8_t *full_row = full.ptr() + ((region.position.y + y) * lookup.width + region.position.x) * 4;
+		CHECK(memcmp(texels + y * region.size.x * 4, full_row, region.size.x * 4) == 0);
+	}
+	CHECK(memcmp(texels + (3 * 6 + 2) * 4, texel, 4) == 0);
+}
+
+TEST_CASE("[Modules][SceneMerge] Atlas lookup only allocates reserved tiles") {
+	const uint32_t tile_size = MeshTextureAtlas::AtlasLookupTiles::TILE_SIZE;
+	MeshTextureAtlas::AtlasLookupTiles lookup;
+	lookup.create(tile_size * 4 + 3, tile_size * 4);
+	CHECK(lookup.tiles.size() == 5 * 4);
+	CHECK(lookup.get_allocated_tile_count() == 0);
+	CHECK(lookup.get_texel(0, 0) == nullptr);
+
+	lookup.reserve(Rect2i(tile_size - 1, tile_size - 1, 2, 2));
+	CHECK(lookup.get_allocated_tile_count() == 4);
+	lookup.reserve(Rect2i(tile_size * 4, 0, tile_size, 1));
+	CHECK_MESSAGE(lookup.get_allocated_tile_count() == 5, "Reserving past the atlas edge is clipped.");
+
+	MeshTextureAtlas::AtlasLookupTexel *texel = lookup.get_texel(tile_size, tile_size);
+	REQUIRE(texel != nullptr);
+	CHECK(texel->material_index == MeshTextureAtlas::INVALID_MATERIAL_ID);
+	texel->material_index = 3;
+	CHECK(lookup.get_tile_row(1, tile_size)[0].material_index == 3);
+	CHECK(lookup.get_texel(tile_size * 2, tile_size * 2) == nullptr);
+	CHECK(lookup.get_texel(tile_size * 4 + 3, 0) == nullptr);
+}
+
+TEST_CASE("[Modules][SceneMerge] Bleed fills empty texels from the nearest solid texel") {
+	const int32_t width = 7;
+	const int32_t height = 5;
+	uint8_t texels[width * height * 4] = {};
+	const uint8_t red[4] = { 255, 0, 0, 255 };
+	const uint8_t green[4] = { 0, 255, 0, 255 };
+	const uint8_t faint[4] = { 9, 9, 9, 100 };
+	memcpy(texels + (1 * width + 1) * 4, red, 4);
+	memcpy(texels + (3 * width + 6) * 4, green, 4);
+	memcpy(texels + (4 * width + 0) * 4, faint, 4);
+	MeshTextureAtlas::bleed_texels(texels, width, height);
+
+	CHECK(memcmp(texels + (0 * width + 0) * 4, red, 3) == 0);
+	CHECK(memcmp(texels + (1 * width + 3) * 4, red, 3) == 0);
+	CHECK(memcmp(texels + (1 * width + 5) * 4, green, 3) == 0);
+	CHECK(memcmp(texels + (4 * width + 6) * 4, green, 3) == 0);
+	CHECK_MESSAGE(texels[(0 * width + 0) * 4 + 3] == 0, "Bled texels keep a zero alpha.");
+	CHECK_MESSAGE(memcmp(texels + (4 * width + 0) * 4, faint, 4) == 0, "Texels below the threshold are neither sources nor filled.");
+	CHECK_MESSAGE(memcmp(texels + (4 * width + 1) * 4, red, 3) == 0, "Texels below the threshold do not bleed.");
+}
+
+TEST_CASE("[Modules][SceneMerge] dilate_image bleeds in place before building mipmaps") {
+	Ref<Image> image = Image::create_empty(4, 4, true, Image::FORMAT_RGBA8);
+	image->set_pixel(2, 1, Color8(40, 80, 120, 255));
+	MeshTextureAtlas::dilate_image(image);
+
+	REQUIRE(image->has_mipmaps());
+	const uint8_t *texels = image->ptr();
+	for (int32_t i = 0; i < 4 * 4; i++) {
+		CHECK(texels[i * 4 + 0] == 40);
+		CHECK(texels[i * 4 + 2] == 120);
+		CHECK(texels[i * 4 + 3] == 255);
+	}
+	const uint8_t *mipmap = texels + image->get_mipmap_offset(1);
+	CHECK_MESSAGE(mipmap[0] == 40, "Mipmaps are built from the bled texels.");
+
+	Ref<Image> transparent = Image::create_empty(4, 4, false, Image::FORMAT_RGBA8);
+	transparent->set_pixel(2, 1, Color8(40, 80, 120, 128));
+	MeshTextureAtlas::dilate_image(transparent, false);
+	CHECK(transparent->get_pixel(2, 1).get_a8() == 128);
+	CHECK_MESSAGE(transparent->get_pixel(0, 0).get_a8() == 0, "Bled texels of a transparent image keep a zero alpha.");
+	CHECK(transparent->get_pixel(0, 0).get_r8() == 40);
+}
+
+TEST_CASE("[Modules][SceneMerge] tint_texels multiplies raw texels") {
+	const int32_t width = 5;
+	const int32_t height = 2;
+	uint8_t source[width * height * 4];
+	for (int32_t i = 0; i < width * height * 4; i++) {
+		source[i] = uint8_t(i * 25);
+	}
+	uint8_t texels[width * height * 4] = {};
+	const Color tint = Color8(255, 128, 0, 51);
+	MeshTextureAtlas::tint_texels(source, texels, width, height, tint);
+	for (int32_t i = 0; i < width * height * 4; i++) {
+		const uint8_t channel = i % 4 == 0 ? 255 : (i % 4 == 1 ? 128 : (i % 4 == 2 ? 0 : 51));
+		CHECK(texels[i] == uint8_t(Math::round(source[i] * channel / 255.0)));
+	}
+}
+
+TEST_CASE("[Modules][SceneMerge] bake_emission_texels applies energy after the emission operator") {
+	const int32_t width = 4;
+	const int32_t height = 2;
+	uint8_t source[width * height * 4];
+	for (int32_t i = 0; i < width * height * 4; i++) {
+		source[i] = uint8_t(i * 31);
+	}
+	const Color emission = Color(0.25, 0.5, 0.0);
+	const float energy = 1.5f;
+	uint8_t added[width * height * 4] = {};
+	MeshTextureAtlas::bake_emission_texels(source, added, width, height, emission, energy, false);
+	uint8_t multiplied[width * height * 4] = {};
+	MeshTextureAtlas::bake_emission_texels(source, multiplied, width, height, emission, energy, true);
+	for (int32_t i = 0; i < width * height * 4; i++) {
+		const int32_t channel = i % 4;
+		if (channel == 3) {
+			CHECK(added[i] == 255);
+			CHECK(multiplied[i] == 255);
+			continue;
+		}
+		const float texel = source[i] / 255.0f;
+		const float color = emission[channel];
+		CHECK(added[i] == uint8_t(CLAMP((texel + color) * energy, 0.0f, 1.0f) * 255.0f + 0.5f));
+		CHECK(multiplied[i] == uint8_t(CLAMP(texel * color * energy, 0.0f, 1.0f) * 255.0f + 0.5f));
+	}
+}
+
+TEST_CASE("[Modules][SceneMerge] SourceImageCache shares resized and tinted images") {
+	MeshTextureAtlas::SourceImageCache cache;
+	Ref<Image> source = Image::create_empty(2, 2, false, Image::FORMAT_RGB8);
+	source->fill(Color(1, 1, 1));
+	cache.images.push_back(source);
+
+	CHECK(cache.get_resized_image(0, 2, 2) != 0);
+	const int32_t resized = cache.get_resized_image(0, 4, 4);
+	CHECK(cache.get_resized_image(0, 4, 4) == resized);
+	CHECK_MESSAGE(source->get_width() == 2, "The shared source image is not modified.");
+	CHECK(cache.images[resized]->get_format() == Image::FORMAT_RGBA8);
+	CHECK(cache.get_resized_image(resized, 4, 4) == resized);
+
+	const Ref<Image> tinted = cache.get_tinted_image(resized, Color(1, 0, 0));
+	REQUIRE(tinted.is_valid());
+	CHECK(cache.get_tinted_image(resized, Color(1, 0, 0)) == tinted);
+	CHECK(cache.get_tinted_image(resized, Color(0, 1, 0)) != tinted);
+	CHECK(tinted->ptr()[0] == 255);
+	CHECK(tinted->ptr()[1] == 0);
+}
+
+// Sixteen separate triangles in source texel space, each one becomes its own chart of about 8x8 texels.
+static xatlas::Atlas *create_triangle_chart_atlas(int32_t p_source_size, uint32_t p_resolution, Vector<Vector2> &r_uvs) {
+	LocalVector<float> uv_data;
+	LocalVector<uint32_t> indices;
+	for (int32_t y = 0; y < 4; y++) {
+		for (int32_t x = 0; x < 4; x++) {
+			const Vector2 corners[3] = { Vector2(x * 8 + 0.5, y * 8 + 0.5), Vector2(x * 8 + 7.5, y * 8 + 1.5), Vector2(x * 8 + 2.5, y * 8 + 7.0) };
+			for (const Vector2 &corner : corners) {
+				indices.push_back(r_uvs.size());
+				r_uvs.push_back(corner / p_source_size);
+				uv_data.push_back(corner.x);
+				uv_data.push_back(corner.y);
+			}
+		}
+	}
+	xatlas::Atlas *atlas = xatlas::Create();
+	xatlas::UvMeshDecl mesh_declaration;
+	mesh_declaration.vertexCount = r_uvs.size();
+	mesh_declaration.vertexUvData = uv_data.ptr();
+	mesh_declaration.vertexStride = sizeof(float) * 2;
+	mesh_declaration.indexCount = indices.size();
+	mesh_declaration.indexData = indices.ptr();
+	mesh_declaration.indexFormat = xatlas::IndexFormat::UInt32;
+	CHECK(xatlas::AddUvMesh(atlas, mesh_declaration) == xatlas::AddMeshError::Success);
+	xatlas::ChartOptions chart_options;
+	chart_options.useInputMeshUvs = true;
+	xatlas::ComputeCharts(atlas, chart_options);
+	xatlas::PackOptions pack_options;
+	pack_options.padding = 2;
+	pack_options.texelsPerUnit = 1.0f;
+	pack_options.resolution = p_resolution;
+	xatlas::PackCharts(atlas, pack_options);
+	return atlas;
+}
+
+TEST_CASE("[Modules][SceneMerge] Parallel chart rasterization matches the serial path") {
+	const int32_t source_size = 32;
+	Vector<Vector2> uvs;
+	xatlas::Atlas *atlas = create_triangle_chart_atlas(source_size, 256, uvs);
+	REQUIRE(atlas->meshCount == 1);
+	REQUIRE(atlas->atlasCount == 1);
+	CHECK(atlas->meshes[0].chartCount > 1);
+
+	Vector<Vector<Vector2> > uv_groups;
+	uv_groups.push_back(uvs);
+	LocalVector<int32_t> atlas_surfaces;
+	atlas_surfaces.push_back(0);
+	LocalVector<Size2i> source_sizes;
+	source_sizes.push_back(Size2i(source_size, source_size));
+	MeshTextureAtlas::AtlasLookupTiles serial;
+	serial.create(atlas->width, atlas->height);
+	MeshTextureAtlas::rasterize_charts(atlas, uv_groups, atlas_surfaces, source_sizes, false, serial);
+	MeshTextureAtlas::AtlasLookupTiles parallel;
+	parallel.create(atlas->width, atlas->height);
+	MeshTextureAtlas::rasterize_charts(atlas, uv_groups, atlas_surfaces, source_sizes, true, parallel);
+
+	LocalVector<uint8_t> source_texels;
+	source_texels.resize(source_size * source_size * 4);
+	for (uint32_t i = 0; i < source_texels.size(); i++) {
+		source_texels[i] = uint8_t(i * 7 + 1);
+	}
+	MeshTextureAtlas::AtlasChannelSource source;
+	source.texels = source_texels.ptr();
+	source.width = source_size;
+	source.height = source_size;
+	LocalVector<uint8_t> serial_texels;
+	serial_texels.resize(atlas->width * atlas->height * 4);
+	memset(serial_texels.ptr(), 0, serial_texels.size());
+	LocalVector<uint8_t> parallel_texels;
+	parallel_texels.resize(serial_texels.size());
+	memset(parallel_texels.ptr(), 0, parallel_texels.size());
+	MeshTextureAtlas::resolve_atlas_channel(serial, &source, 1, false, serial_texels.ptr());
+	MeshTextureAtlas::resolve_atlas_channel(parallel, &source, 1, false, parallel_texels.ptr());
+	xatlas::Destroy(atlas);
+
+	CHECK(serial.get_allocated_tile_count() == parallel.get_allocated_tile_count());
+	CHECK(memcmp(serial_texels.ptr(), parallel_texels.ptr(), serial_texels.size()) == 0);
+	bool any_written = false;
+	for (uint32_t i = 3; i < serial_texels.size(); i += 4) {
+		any_written = any_written || serial_texels[i] != 0;
+	}
+	CHECK_MESSAGE(any_written, "Charts were rasterized into the atlas.");
+}
+
+TEST_CASE("[Modules][SceneMerge] rasterize_charts rejects atlases with more than one page") {
+	const int32_t source_size = 32;
+	Vector<Vector2> uvs;
+	xatlas::Atlas *atlas = create_triangle_chart_atlas(source_size, 16, uvs);
+	REQUIRE(atlas->atlasCount > 1);
+
+	Vector<Vector<Vector2> > uv_groups;
+	uv_groups.push_back(uvs);
+	LocalVector<int32_t> atlas_surfaces;
+	atlas_surfaces.push_back(0);
+	LocalVector<Size2i> source_sizes;
+	source_sizes.push_back(Size2i(source_size, source_size));
+	MeshTextureAtlas::AtlasLookupTiles lookup;
+	lookup.create(atlas->width, atlas->height);
+	ERR_PRINT_OFF;
+	MeshTextureAtlas::rasterize_charts(atlas, uv_groups, atlas_surfaces, source_sizes, true, lookup);
+	ERR_PRINT_ON;
+	xatlas::Destroy(atlas);
+	CHECK_MESSAGE(lookup.get_allocated_tile_count() == 0, "Charts of different pages are not rasterized over each other.");
+}
+
+TEST_CASE("[Modules][SceneMerge] write_uvs keeps source uvs normalised") {
+	MeshTextureAtlas::SurfaceSnapshot surface;
+	surface.vertices.push_back(Vector3(0, 0, 0));
+	surface.vertices.push_back(Vector3(1, 0, 0));
+	surface.vertices.push_back(Vector3(0, 1, 0));
+	surface.normals.resize(3);
+	surface.normals.fill(Vector3(0, 0, 1));
+	surface.uvs.push_back(Vector2(0.25, 0.5));
+	surface.uvs.push_back(Vector2(1.5, 0.0));
+	surface.uvs.push_back(Vector2(0.0, 1.0));
+	surface.indices.push_back(0);
+	surface.indices.push_back(1);
+	surface.indices.push_back(2);
+	Vector<MeshTextureAtlas::SurfaceSnapshot> surfaces;
+	surfaces.push_back(surface);
+
+	Vector<Vector<Vector2> > uv_groups;
+	Vector<Vector<MeshTextureAtlas::ModelVertex> > model_vertices;
+	MeshTextureAtlas::write_uvs(surfaces, uv_groups, model_vertices);
+	REQUIRE(uv_groups.size() == 1);
+	CHECK_MESSAGE(uv_groups[0][0] == Vector2(0.25, 0.5), "Uvs are scaled by the material source size only when rasterizing.");
+	CHECK(uv_groups[0][1] == Vector2(1.5, 0.0));
+}
+
+// A unit quad in the xy plane. Its uvs double as a valid uv2, so merges of it skip the unwrap.
+static Array create_quad_arrays() {
+	PackedVector3Array vertices;
+	PackedVector3Array normals;
+	PackedVector2Array uvs;
+	const Vector2 corners[] = { Vector2(0, 0), Vector2(1, 0), Vector2(1, 1), Vector2(0, 1) };
+	for (const Vector2 &corner : corners) {
+		vertices.push_back(Vector3(corner.x, corner.y, 0));
+		normals.push_back(Vector3(0, 0, 1));
+		uvs.push_back(corner);
+	}
+	PackedInt32Array indices;
+	const int32_t quad_indices[] = { 0, 2, 1, 0, 3, 2 };
+	for (int32_t index : quad_indices) {
+		indices.push_back(index);
+	}
+	Array arrays;
+	arrays.resize(Mesh::ARRAY_MAX);
+	arrays[Mesh::ARRAY_VERTEX] = vertices;
+	arrays[Mesh::ARRAY_NORMAL] = normals;
+	arrays[Mesh::ARRAY_TEX_UV] = uvs;
+	arrays[Mesh::ARRAY_TEX_UV2] = uvs;
+	arrays[Mesh::ARRAY_INDEX] = indices;
+	return arrays;
+}
+
+static Ref<ArrayMesh> create_quad_mesh(const Ref<Material> &p_material = Ref<Material>()) {
+	Ref<ArrayMesh> mesh;
+	mesh.instantiate();
+	mesh->add_surface_from_arrays(Mesh::PRIMITIVE_TRIANGLES, create_quad_arrays());
+	mesh->surface_set_material(0, p_material);
+	return mesh;
+}
+
+TEST_CASE("[Modules][SceneMerge] cluster_mesh_items groups instances by cell and budget") {
+	const Ref<ArrayMesh> mesh = create_quad_mesh();
+
+	const real_t positions[] = { 0.0, 2.0, 100.0, 102.0 };
+	LocalVector<MeshInstance3D *> instances;
+	Vector<MeshTextureAtlas::MeshMerge> items;
+	items.resize(1);
+	for (const real_t position : positions) {
+		MeshInstance3D *instance = memnew(MeshInstance3D);
+		instance->set_mesh(mesh);
+		instance->set_position(Vector3(position, 0, 0));
+		instances.push_back(instance);
+		MeshTextureAtlas::MeshState mesh_state;
+		mesh_state.mesh = mesh;
+		mesh_state.mesh_instance = instance;
+		items.write[0].meshes.push_back(mesh_state);
+	}
+
+	Vector<MeshTextureAtlas::MeshMerge> unclustered = items;
+	MeshTextureAtlas::cluster_mesh_items(unclustered, MeshTextureAtlas::MergeOptions());
+	CHECK_MESSAGE(unclustered.size() == 1, "Without a cell size or budget every instance stays in one group.");
+
+	MeshTextureAtlas::MergeOptions options;
+	options.cluster_cell_size = 10.0f;
+	Vector<MeshTextureAtlas::MeshMerge> cells = items;
+	MeshTextureAtlas::cluster_mesh_items(cells, options);
+	REQUIRE(cells.size() == 2);
+	CHECK(cells[0].meshes.size() == 2);
+	CHECK(cells[1].meshes.size() == 2);
+	CHECK(cells[1].meshes[0].mesh_instance == instances[2]);
+
+	options.cluster_max_triangles = 1;
+	Vector<MeshTextureAtlas::MeshMerge> budgeted = items;
+	MeshTextureAtlas::cluster_mesh_items(budgeted, options);
+	CHECK(budgeted.size() == 4);
+
+	for (MeshInstance3D *instance : instances) {
+		memdelete(instance);
+	}
+}
+
+TEST_CASE("[Modules][SceneMerge] partition_mesh_items_by_material splits render features") {
+	const Array arrays = create_quad_arrays();
+	Ref<ArrayMesh> mesh;
+	mesh.instantiate();
+
+	Ref<StandardMaterial3D> opaque;
+	opaque.instantiate();
+	Ref<StandardMaterial3D> red_opaque;
+	red_opaque.instantiate();
+	red_opaque->set_albedo(Color(1, 0, 0));
+	Ref<StandardMaterial3D> double_sided;
+	double_sided.instantiate();
+	double_sided->set_cull_mode(BaseMaterial3D::CULL_DISABLED);
+	Ref<StandardMaterial3D> scissor;
+	scissor.instantiate();
+	scissor->set_transparency(BaseMaterial3D::TRANSPARENCY_ALPHA_SCISSOR);
+	const Ref<StandardMaterial3D> materials[] = { opaque, red_opaque, double_sided, scissor };
+	for (const Ref<StandardMaterial3D> &material : materials) {
+		mesh->add_surface_from_arrays(Mesh::PRIMITIVE_TRIANGLES, arrays);
+		mesh->surface_set_material(mesh->get_surface_count() - 1, material);
+	}
+	CHECK(MeshTextureAtlas::get_material_feature_key(opaque) == MeshTextureAtlas::get_material_feature_key(red_opaque));
+	CHECK(MeshTextureAtlas::get_material_feature_key(opaque) != MeshTextureAtlas::get_material_feature_key(double_sided));
+
+	MeshInstance3D *instance = memnew(MeshInstance3D);
+	instance->set_mesh(mesh);
+	Vector<MeshTextureAtlas::MeshMerge> items;
+	items.resize(1);
+	for (int32_t surface_i = 0; surface_i < mesh->get_surface_count(); surface_i++) {
+		MeshTextureAtlas::MeshState mesh_state;
+		mesh_state.mesh = mesh;
+		mesh_state.surface_index = surface_i;
+		mesh_state.mesh_instance = instance;
+		items.write[0].meshes.push_back(mesh_state);
+	}
+	MeshTextureAtlas::partition_mesh_items_by_material(items);
+	REQUIRE(items.size() == 3);
+	CHECK_MESSAGE(items[0].meshes.size() == 2, "Materials that only differ in colour share a group.");
+	CHECK(items[1].meshes[0].surface_index == 2);
+	CHECK(items[2].meshes[0].surface_index == 3);
+	memdelete(instance);
+}
+
+static void clear_temp_dir(const String &p_path) {
+	Ref<DirAccess> dir = DirAccess::open(p_path);
+	if (dir.is_valid()) {
+		dir->erase_contents_recursive();
+	}
+}
+
+TEST_CASE("[SceneTree][Modules][SceneMerge] Merging a scissor material keeps the albedo alpha") {
+	Ref<Image> albedo = Image::create_empty(8, 8, false, Image::FORMAT_RGBA8);
+	albedo->fill(Color8(200, 100, 50, 64));
+	Ref<StandardMaterial3D> scissor;
+	scissor.instantiate();
+	scissor->set_transparency(BaseMaterial3D::TRANSPARENCY_ALPHA_SCISSOR);
+	scissor->set_texture(BaseMaterial3D::TEXTURE_ALBEDO, ImageTexture::create_from_image(albedo));
+	const Ref<ArrayMesh> mesh = create_quad_mesh(scissor);
+
+	Node3D *root = memnew(Node3D);
+	root->set_name("ScissorRoot");
+	MeshInstance3D *instance = memnew(MeshInstance3D);
+	instance->set_mesh(mesh);
+	root->add_child(instance);
+
+	// Tiles and caches go to temporary directories, so the test leaves nothing behind in the project.
+	MeshTextureAtlas::MergeOptions options;
+	options.tile_output_path = TestUtils::get_temp_path("scene_merge_scissor");
+	options.cache_path = TestUtils::get_temp_path("scene_merge_scissor_cache");
+	MeshTextureAtlas::merge_meshes(root, options);
+
+	const String tile_path = options.tile_output_path.path_join("ScissorRoot_albedo_0_0.res");
+	const Ref<Image> tile = ResourceLoader::load(tile_path, "Image", ResourceFormatLoader::CACHE_MODE_IGNORE);
+	REQUIRE(tile.is_valid());
+	bool has_translucent_texel = false;
+	bool has_opaque_texel = false;
+	const uint8_t *texels = tile->ptr();
+	for (int64_t i = 0; i < int64_t(tile->get_width()) * tile->get_height(); i++) {
+		has_translucent_texel = has_translucent_texel || (texels[i * 4 + 3] > 0 && texels[i * 4 + 3] < 255);
+		has_opaque_texel = has_opaque_texel || texels[i * 4 + 3] == 255;
+	}
+	CHECK_MESSAGE(has_translucent_texel, "Chart texels keep the alpha of the scissor material.");
+	CHECK_MESSAGE(!has_opaque_texel, "Albedo alpha is not forced to opaque.");
+
+	clear_temp_dir(options.tile_output_path);
+	clear_temp_dir(options.cache_path);
+	// A merged instance is replaced and no longer owned by the scene.
+	const bool replaced = instance->get_parent() == nullptr;
+	memdelete(root);
+	if (replaced) {
+		memdelete(instance);
+	}
+}
+
+// Merges a root holding one quad instance, with its caches in p_cache_dir, and returns the merged mesh.
+static Ref<ArrayMesh> merge_quad_scene(const Ref<Material> &p_material, const Transform3D &p_transform, const String &p_cache_dir) {
+	Node3D *root = memnew(Node3D);
+	root->set_name("CacheRoot");
+	MeshInstance3D *instance = memnew(MeshInstance3D);
+	instance->set_mesh(create_quad_mesh(p_material));
+	instance->set_transform(p_transform);
+	root->add_child(instance);
+	MeshTextureAtlas::MergeOptions options;
+	options.cache_path = p_cache_dir;
+	MeshTextureAtlas::merge_meshes(root, options);
+	Ref<ArrayMesh> merged;
+	for (int32_t child_i = 0; child_i < root->get_child_count(); child_i++) {
+		MeshInstance3D *output = Object::cast_to<MeshInstance3D>(root->get_child(child_i));
+		if (output && output != instance) {
+			merged = output->get_mesh();
+		}
+	}
+	// A merged instance is replaced and no longer owned by the scene.
+	const bool replaced = instance->get_parent() == nullptr;
+	memdelete(root);
+	if (replaced) {
+		memdelete(instance);
+	}
+	return merged;
+}
+
+TEST_CASE("[SceneTree][Modules][SceneMerge] Merge cache hits unchanged inputs and misses edited materials") {
+	const String cache_dir = TestUtils::get_temp_path("scene_merge_cache");
+	clear_temp_dir(cache_dir);
+	Ref<StandardMaterial3D> material;
+	material.instantiate();
+	material->set_albedo(Color(1, 0, 0));
+
+	const Ref<ArrayMesh> first = merge_quad_scene(material, Transform3D(), cache_dir);
+	REQUIRE(first.is_valid());
+	const PackedStringArray files = DirAccess::get_files_at(cache_dir);
+	REQUIRE_MESSAGE(files.size() == 1, "A miss stores the merged mesh.");
+
+	// Renaming the cached mesh marks it, only a hit hands the mark to the output.
+	const String cached_path = cache_dir.path_join(files[0]);
+	Ref<ArrayMesh> cached = ResourceLoader::load(cached_path, "ArrayMesh", ResourceFormatLoader::CACHE_MODE_IGNORE);
+	REQUIRE(cached.is_valid());
+	cached->set_name("cached");
+	REQUIRE(ResourceSaver::save(cached, cached_path) == OK);
+
+	const Ref<ArrayMesh> hit = merge_quad_scene(material, Transform3D(), cache_dir);
+	REQUIRE(hit.is_valid());
+	CHECK(hit->get_name() == "cached");
+	CHECK_MESSAGE(hit->get_path().is_empty(), "The output is embedded rather than referencing the cache.");
+	CHECK(DirAccess::get_files_at(cache_dir).size() == 1);
+
+	material->set_albedo(Color(0, 1, 0));
+	const Ref<ArrayMesh> edited = merge_quad_scene(material, Transform3D(), cache_dir);
+	REQUIRE(edited.is_valid());
+	CHECK_MESSAGE(edited->get_name() != "cached", "Editing a material changes the cache key.");
+	CHECK(DirAccess::get_files_at(cache_dir).size() == 2);
+
+	clear_temp_dir(cache_dir);
+}
+
+TEST_CASE("[SceneTree][Modules][SceneMerge] Cached merges re-transform moved instances") {
+	const String cache_dir = TestUtils::get_temp_path("scene_merge_cache_moved");
+	const String full_dir = TestUtils::get_temp_path("scene_merge_cache_full");
+	clear_temp_dir(cache_dir);
+	clear_temp_dir(full_dir);
+	Ref<StandardMaterial3D> material;
+	material.instantiate();
+	material->set_albedo(Color(0, 0, 1));
+	const Transform3D moved(Basis(Vector3(0, 1, 0), Math::deg_to_rad(60.0)), Vector3(4, -2, 7));
+
+	REQUIRE(merge_quad_scene(material, Transform3D(), cache_dir).is_valid());
+	const Ref<ArrayMesh> retransformed = merge_quad_scene(material, moved, cache_dir);
+	const Ref<ArrayMesh> full = merge_quad_scene(material, moved, full_dir);
+	REQUIRE(retransformed.is_valid());
+	REQUIRE(full.is_valid());
+	CHECK_MESSAGE(DirAccess::get_files_at(cache_dir).size() == 1, "A moved instance reuses the cache entry.");
+
+	const Array retransformed_arrays = retransformed->surface_get_arrays(0);
+	const Array full_arrays = full->surface_get_arrays(0);
+	const PackedVector3Array retransformed_vertices = retransformed_arrays[Mesh::ARRAY_VERTEX];
+	const PackedVector3Array full_vertices = full_arrays[Mesh::ARRAY_VERTEX];
+	const PackedVector3Array retransformed_normals = retransformed_arrays[Mesh::ARRAY_NORMAL];
+	const PackedVector3Array full_normals = full_arrays[Mesh::ARRAY_NORMAL];
+	const PackedFloat32Array retransformed_tangents = retransformed_arrays[Mesh::ARRAY_TANGENT];
+	const PackedFloat32Array full_tangents = full_arrays[Mesh::ARRAY_TANGENT];
+	REQUIRE(retransformed_vertices.size() == full_vertices.size());
+	REQUIRE(retransformed_normals.size() == full_normals.size());
+	REQUIRE(retransformed_tangents.size() == full_tangents.size());
+	for (int32_t vertex_i = 0; vertex_i < full_vertices.size(); vertex_i++) {
+		CHECK(retransformed_vertices[vertex_i].is_equal_approx(full_vertices[vertex_i]));
+		CHECK(retransformed_normals[vertex_i].is_equal_approx(full_normals[vertex_i]));
+	}
+	for (int32_t i = 0; i < full_tangents.size(); i++) {
+		CHECK(Math::abs(retransformed_tangents[i] - full_tangents[i]) < 0.001f);
+	}
+
+	clear_temp_dir(cache_dir);
+	clear_temp_dir(full_dir);
+}
+
+TEST_CASE("[SceneTree][Modules][SceneMerge] Surfaces without uv2 are left out of the atlas") {
+	Ref<Image> albedo = Image::create_empty(8, 8, false, Image::FORMAT_RGBA8);
+	albedo->fill(Color(0.5, 0.25, 1));
+	Ref<StandardMaterial3D> textured;
+	textured.instantiate();
+	textured->set_texture(BaseMaterial3D::TEXTURE_ALBEDO, ImageTexture::create_from_image(albedo));
+	// Primitive meshes are not unwrapped and carry no uv2 unless asked to.
+	Ref<BoxMesh> box;
+	box.instantiate();
+	box->set_material(textured);
+
+	Node3D *root = memnew(Node3D);
+	root->set_name("PrimitiveRoot");
+	MeshInstance3D *quad_instance = memnew(MeshInstance3D);
+	quad_instance->set_mesh(create_quad_mesh(textured));
+	root->add_child(quad_instance);
+	MeshInstance3D *box_instance = memnew(MeshInstance3D);
+	box_instance->set_mesh(box);
+	root->add_child(box_instance);
+
+	const String cache_dir = TestUtils::get_temp_path("scene_merge_primitive");
+	clear_temp_dir(cache_dir);
+	MeshTextureAtlas::MergeOptions options;
+	options.cache_path = cache_dir;
+	ERR_PRINT_OFF;
+	MeshTextureAtlas::merge_meshes(root, options);
+	ERR_PRINT_ON;
+
+	Ref<ArrayMesh> merged;
+	for (int32_t child_i = 0; child_i < root->get_child_count(); child_i++) {
+		MeshInstance3D *output = Object::cast_to<MeshInstance3D>(root->get_child(child_i));
+		if (output && output != quad_instance && output != box_instance) {
+			merged = output->get_mesh();
+		}
+	}
+	REQUIRE(merged.is_valid());
+	CHECK_MESSAGE(merged->get_aabb().is_equal_approx(AABB(Vector3(), Vector3(1, 1, 0))), "Only the quad is merged.");
+
+	clear_temp_dir(cache_dir);
+	const bool quad_replaced = quad_instance->get_parent() == nullptr;
+	const bool box_replaced = box_instance->get_parent() == nullptr;
+	memdelete(root);
+	if (quad_replaced) {
+		memdelete(quad_instance);
+	}
+	if (box_replaced) {
+		memdelete(box_instance);
+	}
+}
+
+TEST_CASE("[SceneTree][Modules][SceneMerge] Flat colour materials sample aligned palette cells") {
+	Ref<Image> albedo = Image::create_empty(8, 8, false, Image::FORMAT_RGBA8);
+	albedo->fill(Color(0.5, 0.5, 0.5));
+	Ref<StandardMaterial3D> textured;
+	textured.instantiate();
+	textured->set_texture(BaseMaterial3D::TEXTURE_ALBEDO, ImageTexture::create_from_image(albedo));
+	Ref<StandardMaterial3D> red;
+	red.instantiate();
+	red->set_albedo(Color(1, 0, 0));
+	Ref<StandardMaterial3D> green;
+	green.instantiate();
+	green->set_albedo(Color(0, 1, 0));
+
+	// Every quad sits at its own x, so the merged vertices tell which material they came from.
+	const Ref<StandardMaterial3D> materials[] = { textured, red, green };
+	Node3D *root = memnew(Node3D);
+	root->set_name("PaletteRoot");
+	LocalVector<MeshInstance3D *> instances;
+	for (int32_t material_i = 0; material_i < 3; material_i++) {
+		MeshInstance3D *instance = memnew(MeshInstance3D);
+		instance->set_mesh(create_quad_mesh(materials[material_i]));
+		instance->set_position(Vector3(material_i * 2, 0, 0));
+		root->add_child(instance);
+		instances.push_back(instance);
+	}
+	const String cache_dir = TestUtils::get_temp_path("scene_merge_palette");
+	clear_temp_dir(cache_dir);
+	MeshTextureAtlas::MergeOptions options;
+	options.cache_path = cache_dir;
+	MeshTextureAtlas::merge_meshes(root, options);
+
+	Ref<ArrayMesh> merged;
+	for (int32_t child_i = 0; child_i < root->get_child_count(); child_i++) {
+		MeshInstance3D *output = Object::cast_to<MeshInstance3D>(root->get_child(child_i));
+		if (output && instances.find(output) < 0) {
+			merged = output->get_mesh();
+		}
+	}
+	REQUIRE(merged.is_valid());
+	const Ref<BaseMaterial3D> merged_material = merged->surface_get_material(0);
+	REQUIRE(merged_material.is_valid());
+	const Ref<Texture2D> atlas_texture = merged_material->get_texture(BaseMaterial3D::TEXTURE_ALBEDO);
+	REQUIRE(atlas_texture.is_valid());
+	Ref<Image> atlas = atlas_texture->get_image();
+	REQUIRE(atlas.is_valid());
+	REQUIRE(atlas->has_mipmaps());
+	atlas->convert(Image::FORMAT_RGBA8);
+
+	const Array arrays = merged->surface_get_arrays(0);
+	const PackedVector3Array vertices = arrays[Mesh::ARRAY_VERTEX];
+	const PackedVector2Array uvs = arrays[Mesh::ARRAY_TEX_UV];
+	const Vector2 atlas_size = atlas->get_size();
+	Color cell_colors[3];
+	for (int32_t material_i = 1; material_i < 3; material_i++) {
+		LocalVector<Vector2> surface_uvs;
+		for (int32_t vertex_i = 0; vertex_i < vertices.size(); vertex_i++) {
+			if (int32_t(Math::floor(vertices[vertex_i].x * 0.5f + 0.25f)) == material_i) {
+				surface_uvs.push_back(uvs[vertex_i]);
+			}
+		}
+		REQUIRE(!surface_uvs.is_empty());
+		for (const Vector2 &uv : surface_uvs) {
+			CHECK_MESSAGE(uv.is_equal_approx(surface_uvs[0]), "Flat colour surfaces get no chart, every vertex samples the cell centre.");
+		}
+		const Vector2 cell_origin = surface_uvs[0] * atlas_size - Vector2(MeshTextureAtlas::PALETTE_CELL_SIZE, MeshTextureAtlas::PALETTE_CELL_SIZE) * 0.5f;
+		const Point2i origin = Point2i(Math::round(cell_origin.x), Math::round(cell_origin.y));
+		CHECK(cell_origin.is_equal_approx(Vector2(origin)));
+		CHECK(origin.x % MeshTextureAtlas::PALETTE_CELL_SIZE == 0);
+		CHECK(origin.y % MeshTextureAtlas::PALETTE_CELL_SIZE == 0);
+
+		cell_colors[material_i] = atlas->get_pixelv(origin);
+		CHECK(cell_colors[material_i].is_equal_approx(materials[material_i]->get_albedo()));
+		// Down to one texel per cell, no mip texel mixes the cell with its neighbours.
+		for (int32_t mip = 0; (MeshTextureAtlas::PALETTE_CELL_SIZE >> mip) > 0 && mip <= atlas->get_mipmap_count(); mip++) {
+			int64_t offset = 0;
+			int64_t size = 0;
+			int32_t width = 0;
+			int32_t height = 0;
+			atlas->get_mipmap_offset_size_and_dimensions(mip, offset, size, width, height);
+			const uint8_t *texels = atlas->ptr() + offset;
+			const int32_t cell_size = MeshTextureAtlas::PALETTE_CELL_SIZE >> mip;
+			bool uniform = true;
+			for (int32_t y = origin.y >> mip; y < (origin.y >> mip) + cell_size && y < height; y++) {
+				for (int32_t x = origin.x >> mip; x < (origin.x >> mip) + cell_size && x < width; x++) {
+					const uint8_t *texel = texels + (int64_t(y) * width + x) * 4;
+					uniform = uniform && Color8(texel[0], texel[1], texel[2], texel[3]) == cell_colors[material_i];
+				}
+			}
+			CHECK_MESSAGE(uniform, vformat("Mip %d of palette cell %d keeps its colour.", mip, material_i));
+		}
+	}
+	CHECK(cell_colors[1] != cell_colors[2]);
+
+	clear_temp_dir(cache_dir);
+	for (MeshInstance3D *instance : instances) {
+		const bool replaced = instance->get_parent() == nullptr;
+		if (replaced) {
+			memdelete(instance);
+		}
+	}
+	memdelete(root);
+}
+
+TEST_CASE("[SceneTree][Modules][SceneMerge] Edits that keep the chart inputs reuse the cached layout") {
+	const String cache_dir = TestUtils::get_temp_path("scene_merge_layout");
+	clear_temp_dir(cache_dir);
+	Ref<Image> albedo = Image::create_empty(8, 8, false, Image::FORMAT_RGBA8);
+	albedo->fill(Color(1, 0, 0));
+	Ref<StandardMaterial3D> material;
+	material.instantiate();
+	material->set_texture(BaseMaterial3D::TEXTURE_ALBEDO, ImageTexture::create_from_image(albedo));
+
+	const Ref<ArrayMesh> first = merge_quad_scene(material, Transform3D(), cache_dir);
+	REQUIRE(first.is_valid());
+	const String layout_dir = cache_dir.path_join("layout");
+	REQUIRE(DirAccess::get_files_at(layout_dir).size() == 1);
+
+	// A new texture misses the merge cache, the charts it fills stay where they were packed.
+	albedo->fill(Color(0, 0, 1));
+	material->set_texture(BaseMaterial3D::TEXTURE_ALBEDO, ImageTexture::create_from_image(albedo));
+	const Ref<ArrayMesh> edited = merge_quad_scene(material, Transform3D(), cache_dir);
+	REQUIRE(edited.is_valid());
+	CHECK(DirAccess::get_files_at(cache_dir).size() == 2);
+	CHECK_MESSAGE(DirAccess::get_files_at(layout_dir).size() == 1, "The texture edit does not pack again.");
+
+	const PackedVector2Array first_uvs = first->surface_get_arrays(0)[Mesh::ARRAY_TEX_UV];
+	const PackedVector2Array edited_uvs = edited->surface_get_arrays(0)[Mesh::ARRAY_TEX_UV];
+	REQUIRE(first_uvs.size() == edited_uvs.size());
+	for (int32_t vertex_i = 0; vertex_i < first_uvs.size(); vertex_i++) {
+		CHECK(first_uvs[vertex_i].is_equal_approx(edited_uvs[vertex_i]));
+	}
+	const Ref<BaseMaterial3D> edited_material = edited->surface_get_material(0);
+	REQUIRE(edited_material.is_valid());
+	const Ref<Texture2D> atlas_texture = edited_material->get_texture(BaseMaterial3D::TEXTURE_ALBEDO);
+	REQUIRE(atlas_texture.is_valid());
+	const Ref<Image> atlas = atlas_texture->get_image();
+	REQUIRE(atlas.is_valid());
+	Vector2 chart_center;
+	for (const Vector2 &uv : edited_uvs) {
+		chart_center += uv / real_t(edited_uvs.size());
+	}
+	chart_center *= Vector2(atlas->get_size());
+	CHECK_MESSAGE(atlas->get_pixelv(Point2i(chart_center)).is_equal_approx(Color(0, 0, 1)), "Charts are rasterized again from the edited texture.");
+
+	clear_temp_dir(cache_dir);
 }
 } // namespace TestSceneMerge
 
@@ -0,0 +1,228 @@
+/**************************************************************************/
+/*  test_scene_merge_benchmark.h                                          */
+/**************************************************************************/
+/*                         This file is part of:                          */
+/*                             GODOT ENGINE                               */
+/*                        https://godotengine.org                         */
+/**************************************************************************/
+/* Copyright (c) 2014-present Godot Engine contributors (see AUTHORS.md). */
+/* Copyright (c) 2007-2014 Juan Linietsky, Ariel Manzur.                  */
+/*                                                                        */
+/* Permission is hereby granted, free of charge, to any person obtaining  */
+/* a copy of this software and associated documentation files (the        */
+/* "Software"), to deal in the Software without restriction, including    */
+/* without limitation the rights to use, copy, modify, merge, publish,    */
+/* distribute, sublicense, and/or sell copies of the Software, and to     */
+/* permit persons to whom the Software is furnished to do so, subject to  */
+/* the following conditions:                                              */
+/*                                                                        */
+/* The above copyright notice and this permission notice shall be         */
+/* included in all copies or substantial portions of the Software.        */
+/*                                                                        */
+/* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,        */
+/* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF     */
+/* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. */
+/* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY   */
+/* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,   */
+/* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE      */
+/* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.                 */
+/**************************************************************************/
+
+#ifndef TEST_SCENE_MERGE_BENCHMARK_H
+#define TEST_SCENE_MERGE_BENCHMARK_H
+
+#include "tests/test_macros.h"
+
+#include "core/math/random_pcg.h"
+#include "core/os/os.h"
+#include "core/templates/local_vector.h"
+
+#include "scene/resources/mesh.h"
+
+#include "modules/scene_merge/merge.h"
+#include "modules/scene_merge/mesh_merge_triangle.h"
+#include "thirdparty/misc/rjm_texbleed.h"
+
+// Benchmarks are skipped by default, run them with `--test --no-skip --test-case="*[Benchmark]*"`.
+namespace TestSceneMergeBenchmark {
+
+static uint64_t bench_set_atlas_texel(MeshTextureAtlas::AtlasTextureArguments &p_args) {
+	const uint64_t begin = OS::get_singleton()->get_ticks_usec();
+	for (uint32_t y = 0; y < p_args.atlas_height; y++) {
+		for (uint32_t x = 0; x < p_args.atlas_width; x++) {
+			const float u = float(x) / p_args.atlas_width;
+			const float v = float(y) / p_args.atlas_height;
+			MeshTextureAtlas::set_atlas_texel(&p_args, x, y, Vector3(u, v, 1.0f - u - v), Vector3(), Vector3(), 1.0f);
+		}
+	}
+	return OS::get_singleton()->get_ticks_usec() - begin;
+}
+
+TEST_CASE("[Modules][SceneMerge][Benchmark] set_atlas_texel raw bytes versus Image pixels" * doctest::skip()) {
+	const int32_t atlas_size = 4096;
+	Ref<Image> source = Image::create_empty(2048, 2048, false, Image::FORMAT_RGBA8);
+	source->fill(Color(0.25f, 0.5f, 0.75f, 1.0f));
+	MeshTextureAtlas::AtlasLookupTiles lookup;
+	lookup.create(atlas_size, atlas_size);
+	lookup.reserve(Rect2i(0, 0, atlas_size, atlas_size));
+
+	MeshTextureAtlas::AtlasTextureArguments args;
+	args.atlas_data = Image::create_empty(atlas_size, atlas_size, false, Image::FORMAT_RGBA8);
+	args.source_texture = source;
+	args.atlas_lookup = &lookup;
+	args.atlas_width = atlas_size;
+	args.atlas_height = atlas_size;
+	args.source_uvs[0] = Vector2(0, 0);
+	args.source_uvs[1] = Vector2(1, 0);
+	args.source_uvs[2] = Vector2(0, 1);
+	const uint64_t image_usec = bench_set_atlas_texel(args);
+
+	args.atlas_texels = args.atlas_data->ptrw();
+	args.source_texels = source->ptr();
+	args.source_width = source->get_width();
+	args.source_height = source->get_height();
+	const uint64_t raw_usec = bench_set_atlas_texel(args);
+
+	print_line(vformat("set_atlas_texel %dx%d: Image path %d ms, raw path %d ms (%.1fx).", atlas_size, atlas_size, image_usec / 1000, raw_usec / 1000, double(image_usec) / MAX(raw_usec, uint64_t(1))));
+}
+
+static bool bench_write_texel(void *param, int x, int y, const Vector3 &bar, const Vector3 &, const Vector3 &, float) {
+	uint8_t *texels = static_cast<uint8_t *>(param);
+	texels[y * 4096 + x] = uint8_t(bar.x * 255.0f);
+	return true;
+}
+
+TEST_CASE("[Modules][SceneMerge][Benchmark] drawAA sampler functor versus callback" * doctest::skip()) {
+	const int32_t atlas_size = 4096;
+	LocalVector<uint8_t> texels;
+	texels.resize(atlas_size * atlas_size);
+	LocalVector<MeshMergeTriangle> triangles;
+	RandomPCG rng(42);
+	for (int32_t i = 0; i < 200000; i++) {
+		const Vector2 origin(rng.random(0.0f, float(atlas_size - 64)), rng.random(0.0f, float(atlas_size - 64)));
+		triangles.push_back(MeshMergeTriangle(origin, origin + Vector2(rng.random(0.0f, 64.0f), rng.random(0.0f, 64.0f)), origin + Vector2(rng.random(0.0f, 64.0f), rng.random(0.0f, 64.0f)), Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1)));
+	}
+
+	uint64_t begin = OS::get_singleton()->get_ticks_usec();
+	for (MeshMergeTriangle &triangle : triangles) {
+		triangle.drawAA(bench_write_texel, texels.ptr());
+	}
+	const uint64_t callback_usec = OS::get_singleton()->get_ticks_usec() - begin;
+
+	uint8_t *ptr = texels.ptr();
+	auto sampler = [ptr](int x, int y, const Vector3 &bar, float) {
+		ptr[y * 4096 + x] = uint8_t(bar.x * 255.0f);
+		return true;
+	};
+	begin = OS::get_singleton()->get_ticks_usec();
+	for (MeshMergeTriangle &triangle : triangles) {
+		triangle.drawAA(sampler);
+	}
+	const uint64_t sampler_usec = OS::get_singleton()->get_ticks_usec() - begin;
+
+	print_line(vformat("drawAA %d triangles: callback %d ms, sampler %d ms (%.2fx).", triangles.size(), callback_usec / 1000, sampler_usec / 1000, double(callback_usec) / MAX(sampler_usec, uint64_t(1))));
+}
+
+static Ref<ArrayMesh> bench_create_grid_mesh(int32_t p_side) {
+	PackedVector3Array vertices;
+	PackedVector3Array normals;
+	PackedVector2Array uvs;
+	PackedInt32Array indices;
+	for (int32_t y = 0; y < p_side; y++) {
+		for (int32_t x = 0; x < p_side; x++) {
+			vertices.push_back(Vector3(x, 0, y));
+			normals.push_back(Vector3(0, 1, 0));
+			uvs.push_back(Vector2(x, y) / p_side);
+		}
+	}
+	for (int32_t y = 0; y < p_side - 1; y++) {
+		for (int32_t x = 0; x < p_side - 1; x++) {
+			const int32_t i = y * p_side + x;
+			indices.append_array({ i, i + 1, i + p_side, i + 1, i + p_side + 1, i + p_side });
+		}
+	}
+	Array arrays;
+	arrays.resize(Mesh::ARRAY_MAX);
+	arrays[Mesh::ARRAY_VERTEX] = vertices;
+	arrays[Mesh::ARRAY_NORMAL] = normals;
+	arrays[Mesh::ARRAY_TEX_UV] = uvs;
+	arrays[Mesh::ARRAY_INDEX] = indices;
+	Ref<ArrayMesh> mesh;
+	mesh.instantiate();
+	mesh->add_surface_from_arrays(Mesh::PRIMITIVE_TRIANGLES, arrays);
+	return mesh;
+}
+
+TEST_CASE("[SceneTree][Modules][SceneMerge][Benchmark] write_uvs scales linearly with vertex count" * doctest::skip()) {
+	double first_usec_per_vertex = 0.0;
+	double last_usec_per_vertex = 0.0;
+	for (int32_t side = 128; side <= 1024; side *= 2) {
+		Ref<ArrayMesh> mesh = bench_create_grid_mesh(side);
+		MeshInstance3D *mesh_instance = memnew(MeshInstance3D);
+		mesh_instance->set_mesh(mesh);
+		MeshTextureAtlas::MeshState mesh_state;
+		mesh_state.mesh = mesh;
+		mesh_state.mesh_instance = mesh_instance;
+		Vector<MeshTextureAtlas::MeshState> mesh_items;
+		mesh_items.push_back(mesh_state);
+		Vector<uint16_t> surface_material_ids;
+		surface_material_ids.push_back(0);
+
+		Vector<MeshTextureAtlas::SurfaceSnapshot> surfaces;
+		MeshTextureAtlas::snapshot_surfaces(mesh_items, surface_material_ids, surfaces);
+		memdelete(mesh_instance);
+
+		Vector<Vector<Vector2> > uv_groups;
+		Vector<Vector<MeshTextureAtlas::ModelVertex> > model_vertices;
+		const uint64_t begin = OS::get_singleton()->get_ticks_usec();
+		MeshTextureAtlas::write_uvs(surfaces, uv_groups, model_vertices);
+		const uint64_t usec = OS::get_singleton()->get_ticks_usec() - begin;
+
+		const int32_t vertex_count = side * side;
+		last_usec_per_vertex = double(usec) / vertex_count;
+		if (first_usec_per_vertex == 0.0) {
+			first_usec_per_vertex = last_usec_per_vertex;
+		}
+		print_line(vformat("write_uvs %d vertices: %d ms (%.3f usec per vertex).", vertex_count, usec / 1000, last_usec_per_vertex));
+		CHECK(model_vertices.size() == 1);
+		CHECK(uv_groups[0].size() == vertex_count);
+	}
+	print_line(vformat("write_uvs time per vertex grew %.2fx from the smallest to the largest mesh.", last_usec_per_vertex / MAX(first_usec_per_vertex, 1e-9)));
+}
+
+TEST_CASE("[Modules][SceneMerge][Benchmark] bleed_texels versus rjm_texbleed" * doctest::skip()) {
+	for (int32_t atlas_size = 2048; atlas_size <= 8192; atlas_size *= 2) {
+		// Sparse solid blocks, like charts packed with padding.
+		LocalVector<uint8_t> texels;
+		texels.resize(atlas_size * atlas_size * 4);
+		memset(texels.ptr(), 0, texels.size());
+		RandomPCG rng(42);
+		for (int32_t block_i = 0; block_i < 4000; block_i++) {
+			const int32_t block_x = rng.rand() % (atlas_size - 32);
+			const int32_t block_y = rng.rand() % (atlas_size - 32);
+			const uint8_t value = rng.rand() % 256;
+			for (int32_t y = block_y; y < block_y + 32; y++) {
+				for (int32_t x = block_x; x < block_x + 32; x++) {
+					uint8_t *texel = texels.ptr() + (y * atlas_size + x) * 4;
+					texel[0] = value;
+					texel[3] = 255;
+				}
+			}
+		}
+		LocalVector<uint8_t> reference = texels;
+
+		uint64_t begin = OS::get_singleton()->get_ticks_usec();
+		rjm_texbleed(reference.ptr(), atlas_size, atlas_size, 3, 4, atlas_size * 4);
+		const uint64_t rjm_usec = OS::get_singleton()->get_ticks_usec() - begin;
+
+		begin = OS::get_singleton()->get_ticks_usec();
+		MeshTextureAtlas::bleed_texels(texels.ptr(), atlas_size, atlas_size);
+		const uint64_t bleed_usec = OS::get_singleton()->get_ticks_usec() - begin;
+
+		print_line(vformat("Bleed %dx%d: rjm_texbleed %d ms, bleed_texels %d ms (%.1fx).", atlas_size, atlas_size, rjm_usec / 1000, bleed_usec / 1000, double(rjm_usec) / MAX(bleed_usec, uint64_t(1))));
+	}
+}
+
+} // namespace TestSceneMergeBenchmark
+
+#endif // TEST_SCENE_MERGE_BENCHMARK_H